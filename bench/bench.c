@@ -0,0 +1,316 @@
+/*
+ * Microbenchmarks for the code that writes into framebuffers: fills,
+ * copies, format conversion and scaling, each run against plain heap
+ * memory and, given a DRM device, a real write-combined dumb buffer.
+ */
+#include <drm_fourcc.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blit.h"
+#include "fb.h"
+#include "stream.h"
+#include "timing.h"
+
+struct resolution {
+	uint32_t width;
+	uint32_t height;
+};
+
+static const struct resolution default_resolutions[] = {
+	{ 800, 480 },
+	{ 1280, 720 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+};
+
+#define MAX_RESOLUTIONS 16
+
+/*
+ * One benchmarked operation: write a whole frame into 'fb' from 'src',
+ * a 'src_width' x 'src_height' XRGB8888 image.
+ */
+struct kernel {
+	const char *name;
+	uint32_t format; // of the framebuffer it writes
+	void (*run)(struct dumb_framebuffer *fb, const uint32_t *src,
+			uint32_t src_width, uint32_t src_height);
+};
+
+static void run_fill(struct dumb_framebuffer *fb, const uint32_t *src,
+		uint32_t src_width, uint32_t src_height)
+{
+	fill_rect(fb, 0, 0, fb->width, fb->height, 0x336699);
+}
+
+static void run_memcpy(struct dumb_framebuffer *fb, const uint32_t *src,
+		uint32_t src_width, uint32_t src_height)
+{
+	for (uint32_t y = 0; y < fb->height; ++y) {
+		memcpy(fb->data + (size_t)y * fb->stride, src + (size_t)y * src_width,
+				(size_t)fb->width * 4);
+	}
+}
+
+static void run_copy(struct dumb_framebuffer *fb, const uint32_t *src,
+		uint32_t src_width, uint32_t src_height)
+{
+	for (uint32_t y = 0; y < fb->height; ++y)
+		fb_write_row(fb, 0, y, src + (size_t)y * src_width, fb->width);
+}
+
+static void write_scaled_row(void *user_data, uint32_t y, const uint32_t *row)
+{
+	struct dumb_framebuffer *fb = user_data;
+	fb_write_row(fb, 0, y, row, fb->width);
+}
+
+static void run_nearest(struct dumb_framebuffer *fb, const uint32_t *src,
+		uint32_t src_width, uint32_t src_height)
+{
+	scale_image_rows(fb->width, fb->height, (const uint8_t *)src, src_width * 4,
+			src_width, src_height, SCALE_NEAREST, write_scaled_row, fb);
+}
+
+static void run_bilinear(struct dumb_framebuffer *fb, const uint32_t *src,
+		uint32_t src_width, uint32_t src_height)
+{
+	scale_image_rows(fb->width, fb->height, (const uint8_t *)src, src_width * 4,
+			src_width, src_height, SCALE_BILINEAR, write_scaled_row, fb);
+}
+
+static const struct kernel kernels[] = {
+	{ "fill",     DRM_FORMAT_XRGB8888, run_fill },
+	{ "fill565",  DRM_FORMAT_RGB565,   run_fill },
+	{ "memcpy",   DRM_FORMAT_XRGB8888, run_memcpy },
+	{ "copy",     DRM_FORMAT_XRGB8888, run_copy },
+	{ "conv565",  DRM_FORMAT_RGB565,   run_copy },
+	{ "convc8",   DRM_FORMAT_C8,       run_copy },
+	{ "nearest",  DRM_FORMAT_XRGB8888, run_nearest },
+	{ "near565",  DRM_FORMAT_RGB565,   run_nearest },
+	{ "nearc8",   DRM_FORMAT_C8,       run_nearest },
+	{ "bilinear", DRM_FORMAT_XRGB8888, run_bilinear },
+	{ "bilin565", DRM_FORMAT_RGB565,   run_bilinear },
+	{ "bilinc8",  DRM_FORMAT_C8,       run_bilinear },
+};
+
+/*
+ * A framebuffer-shaped chunk of heap memory, for comparison with the
+ * write-combined mapping of a dumb buffer.
+ */
+static bool create_heap_fb(uint32_t width, uint32_t height, uint32_t format,
+		struct dumb_framebuffer *fb)
+{
+	*fb = (struct dumb_framebuffer) {
+		.width = width,
+		.height = height,
+		.format = format,
+		.cpp = format_cpp(format),
+	};
+
+	// Dumb buffer pitches are usually aligned to 64 bytes as well
+	fb->stride = (width * fb->cpp + 63) & ~63u;
+	fb->size = (uint64_t)fb->stride * height;
+	fb->data = aligned_alloc(64, fb->size);
+	if (!fb->data) {
+		perror("aligned_alloc");
+		return false;
+	}
+
+	memset(fb->data, 0, fb->size);
+	return true;
+}
+
+/*
+ * Run 'kernel' 'iterations' times on a fresh framebuffer of 'res' and print
+ * the time per frame and the rate the framebuffer was written at.
+ */
+static void bench(int drm_fd, const struct kernel *kernel, const struct resolution *res,
+		const uint32_t *src, int iterations)
+{
+	struct fill_policy none = { .mode = FILL_NONE };
+	struct dumb_framebuffer fb;
+
+	bool ok = drm_fd < 0 ? create_heap_fb(res->width, res->height, kernel->format, &fb)
+		: create_fb(drm_fd, res->width, res->height, kernel->format, &none, &fb);
+	if (!ok) {
+		fprintf(stderr, "Failed to create a %"PRIu32"x%"PRIu32" framebuffer\n",
+				res->width, res->height);
+		return;
+	}
+
+	// Scaling goes from a source 3/4 the size, like a splash fit to a panel
+	uint32_t src_width = res->width;
+	uint32_t src_height = res->height;
+	if (kernel->run == run_nearest || kernel->run == run_bilinear) {
+		src_width = res->width * 3 / 4;
+		src_height = res->height * 3 / 4;
+	}
+
+	// One untimed run, so page faults on the mapping don't count
+	kernel->run(&fb, src, src_width, src_height);
+
+	uint64_t start = timing_now();
+	for (int i = 0; i < iterations; ++i)
+		kernel->run(&fb, src, src_width, src_height);
+	uint64_t elapsed = timing_now() - start;
+
+	double frame_ms = elapsed / 1e6 / iterations;
+	double bytes = (double)res->width * res->height * fb.cpp;
+	char size[24];
+	snprintf(size, sizeof size, "%"PRIu32"x%"PRIu32, res->width, res->height);
+
+	printf("%-5s %-9s %-10s %9.3f ms %8.2f GB/s\n", drm_fd < 0 ? "heap" : "dumb",
+			kernel->name, size, frame_ms, bytes / frame_ms / 1e6);
+	fflush(stdout);
+
+	if (drm_fd < 0)
+		free(fb.data);
+	else
+		destroy_fb(drm_fd, &fb);
+}
+
+static bool parse_resolution(const char *str, struct resolution *res)
+{
+	char *end;
+	unsigned long width = strtoul(str, &end, 10);
+	if (end == str || *end != 'x')
+		return false;
+
+	const char *height_str = end + 1;
+	unsigned long height = strtoul(height_str, &end, 10);
+	if (end == height_str || *end != '\0' || width == 0 || height == 0 ||
+			width > 16384 || height > 16384)
+		return false;
+
+	res->width = width;
+	res->height = height;
+	return true;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+			"\n"
+			"Options:\n"
+			"  -d, --device PATH      Also run against dumb buffers on the DRM device at\n"
+			"                         PATH, e.g. /dev/dri/card0 (vkms works too)\n"
+			"  -r, --resolution WxH   Resolution to run at; may be given more than once\n"
+			"                         (default: 800x480, 1280x720, 1920x1080, 3840x2160)\n"
+			"  -k, --kernel NAME      Only run the kernel NAME\n"
+			"  -n, --iterations N     Frames per kernel and resolution (default: 20)\n"
+			"  -h, --help             Show this help\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *device_path = NULL;
+	const char *only_kernel = NULL;
+	struct resolution resolutions[MAX_RESOLUTIONS];
+	int num_resolutions = 0;
+	int iterations = 20;
+
+	static const struct option long_options[] = {
+		{ "device",     required_argument, NULL, 'd' },
+		{ "resolution", required_argument, NULL, 'r' },
+		{ "kernel",     required_argument, NULL, 'k' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "help",       no_argument,       NULL, 'h' },
+		{ 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "d:r:k:n:h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			device_path = optarg;
+			break;
+		case 'r':
+			if (num_resolutions == MAX_RESOLUTIONS ||
+					!parse_resolution(optarg, &resolutions[num_resolutions])) {
+				fprintf(stderr, "Invalid resolution '%s'\n", optarg);
+				return 1;
+			}
+			num_resolutions++;
+			break;
+		case 'k':
+			only_kernel = optarg;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations <= 0) {
+				fprintf(stderr, "Invalid iteration count '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (num_resolutions == 0) {
+		num_resolutions = sizeof default_resolutions / sizeof *default_resolutions;
+		memcpy(resolutions, default_resolutions, sizeof default_resolutions);
+	}
+
+	int drm_fd = -1;
+	if (device_path) {
+		drm_fd = open(device_path, O_RDWR | O_CLOEXEC);
+		if (drm_fd < 0) {
+			perror(device_path);
+			return 1;
+		}
+	}
+
+	// A source big enough for the largest resolution, with something other
+	// than a single colour in it so nothing gets to take shortcuts
+	uint32_t max_width = 0, max_height = 0;
+	for (int i = 0; i < num_resolutions; ++i) {
+		if (resolutions[i].width > max_width)
+			max_width = resolutions[i].width;
+		if (resolutions[i].height > max_height)
+			max_height = resolutions[i].height;
+	}
+
+	size_t src_size = (size_t)max_width * max_height;
+	uint32_t *src = malloc(src_size * 4);
+	if (!src) {
+		perror("malloc");
+		return 1;
+	}
+	for (size_t i = 0; i < src_size; ++i)
+		src[i] = (uint32_t)(i * 2654435761u) & 0xffffff;
+
+	printf("Using %s framebuffer writes\n", stream_impl());
+	printf("%-5s %-9s %-10s %12s %13s\n", "mem", "kernel", "size", "per frame", "written");
+	fflush(stdout);
+
+	size_t num_kernels = sizeof kernels / sizeof *kernels;
+	for (int pass = 0; pass < (drm_fd < 0 ? 1 : 2); ++pass) {
+		for (size_t k = 0; k < num_kernels; ++k) {
+			if (only_kernel && strcmp(only_kernel, kernels[k].name) != 0)
+				continue;
+
+			for (int r = 0; r < num_resolutions; ++r) {
+				bench(pass ? drm_fd : -1, &kernels[k], &resolutions[r], src,
+						iterations);
+			}
+		}
+	}
+
+	free(src);
+	if (drm_fd >= 0)
+		close(drm_fd);
+	return 0;
+}
@@ -0,0 +1,247 @@
+#include "blit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Source coordinate for destination pixel 'i', sampling at pixel
+ * centres, in 16.16 fixed point. Negative near the left/top edge.
+ */
+static int64_t sample_pos(uint32_t i, uint32_t src_size, uint32_t dst_size)
+{
+	return (((int64_t)i * 2 + 1) * src_size << 16) / (2 * (int64_t)dst_size) - (1 << 15);
+}
+
+/*
+ * The scalers write every row into 'd', 'dst_width' pixels long, and then
+ * hand it to 'fn'.
+ */
+static void scale_nearest(uint32_t *d, uint32_t dst_width, uint32_t dst_height,
+		const uint8_t *src, uint32_t src_stride, uint32_t src_height, const uint32_t *xmap,
+		scale_row_fn fn, void *user_data)
+{
+	for (uint32_t y = 0; y < dst_height; ++y) {
+		uint32_t sy = ((uint64_t)y * 2 + 1) * src_height / (2 * (uint64_t)dst_height);
+		const uint32_t *s = (const uint32_t *)(src + (size_t)sy * src_stride);
+		uint32_t x = 0;
+
+#if defined(__SSE2__)
+		for (; x + 4 <= dst_width; x += 4) {
+			__m128i v = _mm_set_epi32(s[xmap[x + 3]], s[xmap[x + 2]],
+					s[xmap[x + 1]], s[xmap[x]]);
+			_mm_storeu_si128((__m128i *)(d + x), v);
+		}
+#elif defined(__ARM_NEON)
+		for (; x + 4 <= dst_width; x += 4) {
+			uint32x4_t v = vdupq_n_u32(s[xmap[x]]);
+			v = vsetq_lane_u32(s[xmap[x + 1]], v, 1);
+			v = vsetq_lane_u32(s[xmap[x + 2]], v, 2);
+			v = vsetq_lane_u32(s[xmap[x + 3]], v, 3);
+			vst1q_u32(d + x, v);
+		}
+#endif
+		for (; x < dst_width; ++x)
+			d[x] = s[xmap[x]];
+
+		fn(user_data, y, d);
+	}
+}
+
+/*
+ * out = (a * (256 - w) + b * w) >> 8 for every byte of 'count' pixels.
+ * Both products fit in 16 bits, as does their sum.
+ */
+static void blend_rows(uint32_t *out, const uint32_t *a, const uint32_t *b,
+		uint32_t count, uint32_t w)
+{
+	uint32_t x = 0;
+
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	__m128i wa = _mm_set1_epi16(256 - w);
+	__m128i wb = _mm_set1_epi16(w);
+	for (; x + 4 <= count; x += 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+		__m128i lo = _mm_add_epi16(
+				_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+				_mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+		__m128i hi = _mm_add_epi16(
+				_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+				_mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+		__m128i v = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+		_mm_storeu_si128((__m128i *)(out + x), v);
+	}
+#elif defined(__ARM_NEON)
+	// Only called with 0 < w < 256, so both weights fit in a byte
+	uint8x8_t wa = vdup_n_u8(256 - w);
+	uint8x8_t wb = vdup_n_u8(w);
+	for (; x + 4 <= count; x += 4) {
+		uint8x16_t va = vreinterpretq_u8_u32(vld1q_u32(a + x));
+		uint8x16_t vb = vreinterpretq_u8_u32(vld1q_u32(b + x));
+		uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(va), wa), vget_low_u8(vb), wb);
+		uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(va), wa), vget_high_u8(vb), wb);
+		uint8x16_t v = vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+		vst1q_u32(out + x, vreinterpretq_u32_u8(v));
+	}
+#endif
+	for (; x < count; ++x) {
+		uint32_t pa = a[x], pb = b[x], p = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			uint32_t ca = (pa >> shift) & 0xff, cb = (pb >> shift) & 0xff;
+			p |= ((ca * (256 - w) + cb * w) >> 8) << shift;
+		}
+		out[x] = p;
+	}
+}
+
+/*
+ * Horizontal pass of the bilinear filter: each output pixel blends the
+ * pair of pixels at 'xmap[x]' and 'xmap[x] + 1' by 'xfrac[x]'.
+ */
+static void blend_columns(uint32_t *d, const uint32_t *row, uint32_t count,
+		const uint32_t *xmap, const uint16_t *xfrac)
+{
+	uint32_t x = 0;
+
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	for (; x < count; ++x) {
+		// Both pixels of the pair, one per 64-bit half after widening
+		__m128i pair = _mm_unpacklo_epi8(
+				_mm_loadl_epi64((const __m128i *)(row + xmap[x])), zero);
+		uint16_t w = xfrac[x];
+		__m128i weights = _mm_set_epi16(w, w, w, w, 256 - w, 256 - w, 256 - w, 256 - w);
+		__m128i v = _mm_mullo_epi16(pair, weights);
+		v = _mm_add_epi16(v, _mm_srli_si128(v, 8));
+		v = _mm_srli_epi16(v, 8);
+		d[x] = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+	}
+#elif defined(__ARM_NEON)
+	for (; x < count; ++x) {
+		uint16_t w = xfrac[x];
+		uint16x8_t pair = vmovl_u8(vld1_u8((const uint8_t *)(row + xmap[x])));
+		uint16x8_t weights = vcombine_u16(vdup_n_u16(256 - w), vdup_n_u16(w));
+		pair = vmulq_u16(pair, weights);
+		uint16x4_t sum = vadd_u16(vget_low_u16(pair), vget_high_u16(pair));
+		uint8x8_t v = vmovn_u16(vcombine_u16(vshr_n_u16(sum, 8), vdup_n_u16(0)));
+		d[x] = vget_lane_u32(vreinterpret_u32_u8(v), 0);
+	}
+#endif
+	for (; x < count; ++x) {
+		uint32_t pa = row[xmap[x]], pb = row[xmap[x] + 1], p = 0;
+		uint32_t w = xfrac[x];
+		for (int shift = 0; shift < 32; shift += 8) {
+			uint32_t ca = (pa >> shift) & 0xff, cb = (pb >> shift) & 0xff;
+			p |= ((ca * (256 - w) + cb * w) >> 8) << shift;
+		}
+		d[x] = p;
+	}
+}
+
+static bool scale_bilinear(uint32_t *d, uint32_t dst_width, uint32_t dst_height,
+		const uint8_t *src, uint32_t src_stride, uint32_t src_width, uint32_t src_height,
+		uint32_t *xmap, scale_row_fn fn, void *user_data)
+{
+	uint16_t *xfrac = malloc(dst_width * sizeof *xfrac);
+	// One spare pixel so pairs at the right edge never read past the row
+	uint32_t *row = malloc((src_width + 1) * sizeof *row);
+	if (!xfrac || !row) {
+		perror("malloc");
+		free(xfrac);
+		free(row);
+		return false;
+	}
+
+	for (uint32_t x = 0; x < dst_width; ++x) {
+		int64_t pos = sample_pos(x, src_width, dst_width);
+		if (pos < 0) {
+			xmap[x] = 0;
+			xfrac[x] = 0;
+		} else if ((pos >> 16) >= src_width - 1) {
+			xmap[x] = src_width - 1;
+			xfrac[x] = 0;
+		} else {
+			xmap[x] = pos >> 16;
+			xfrac[x] = (pos >> 8) & 0xff;
+		}
+	}
+
+	for (uint32_t y = 0; y < dst_height; ++y) {
+		int64_t pos = sample_pos(y, src_height, dst_height);
+		uint32_t y0, w;
+		if (pos < 0) {
+			y0 = 0;
+			w = 0;
+		} else if ((pos >> 16) >= src_height - 1) {
+			y0 = src_height - 1;
+			w = 0;
+		} else {
+			y0 = pos >> 16;
+			w = (pos >> 8) & 0xff;
+		}
+
+		// Vertical pass into the scratch row, horizontal pass into 'd'
+		const uint32_t *a = (const uint32_t *)(src + (size_t)y0 * src_stride);
+		if (w == 0) {
+			memcpy(row, a, src_width * sizeof *row);
+		} else {
+			const uint32_t *b = (const uint32_t *)(src + (size_t)(y0 + 1) * src_stride);
+			blend_rows(row, a, b, src_width, w);
+		}
+		row[src_width] = row[src_width - 1];
+
+		blend_columns(d, row, dst_width, xmap, xfrac);
+		fn(user_data, y, d);
+	}
+
+	free(xfrac);
+	free(row);
+	return true;
+}
+
+/*
+ * Scale a 'src_width' x 'src_height' XRGB8888 image, 'src_stride' bytes per
+ * row, to 'dst_width' x 'dst_height'. Each row is scaled into a small buffer
+ * that stays in the cache and handed to 'fn', e.g. to convert it or write it
+ * out with streaming stores, so the destination is never read.
+ */
+bool scale_image_rows(uint32_t dst_width, uint32_t dst_height,
+		const uint8_t *src, uint32_t src_stride, uint32_t src_width, uint32_t src_height,
+		enum scale_filter filter, scale_row_fn fn, void *user_data)
+{
+	if (dst_width == 0 || dst_height == 0)
+		return true;
+
+	uint32_t *xmap = malloc(dst_width * sizeof *xmap);
+	uint32_t *row = malloc(dst_width * sizeof *row);
+	if (!xmap || !row) {
+		perror("malloc");
+		free(xmap);
+		free(row);
+		return false;
+	}
+
+	bool ok = true;
+	if (filter == SCALE_BILINEAR) {
+		ok = scale_bilinear(row, dst_width, dst_height,
+				src, src_stride, src_width, src_height, xmap, fn, user_data);
+	} else {
+		for (uint32_t x = 0; x < dst_width; ++x)
+			xmap[x] = ((uint64_t)x * 2 + 1) * src_width / (2 * (uint64_t)dst_width);
+
+		scale_nearest(row, dst_width, dst_height,
+				src, src_stride, src_height, xmap, fn, user_data);
+	}
+
+	free(xmap);
+	free(row);
+	return ok;
+}
@@ -0,0 +1,29 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum scale_filter {
+	SCALE_NONE,     // 1:1, centred and cropped
+	SCALE_NEAREST,
+	SCALE_BILINEAR,
+};
+
+/*
+ * Called by scale_image_rows() for every scaled row, top to bottom.
+ * 'row' is only valid during the call.
+ */
+typedef void (*scale_row_fn)(void *user_data, uint32_t y, const uint32_t *row);
+
+/*
+ * Scale a 'src_width' x 'src_height' XRGB8888 image, 'src_stride' bytes per
+ * row, to 'dst_width' x 'dst_height'. Each row is scaled into a small buffer
+ * that stays in the cache and handed to 'fn', e.g. to convert it or write it
+ * out with streaming stores, so the destination is never read.
+ */
+bool scale_image_rows(uint32_t dst_width, uint32_t dst_height,
+		const uint8_t *src, uint32_t src_stride, uint32_t src_width, uint32_t src_height,
+		enum scale_filter filter, scale_row_fn fn, void *user_data);
+
+#endif
@@ -0,0 +1,121 @@
+#include "cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stream.h"
+
+static const char cache_magic[8] = { 'd', 'r', 'm', 'f', 'b', 'c', '0', '1' };
+
+/*
+ * What's at the start of every cache file, followed by the framebuffer
+ * rows without any padding. It's only ever read back on the same machine,
+ * so it's stored in native byte order.
+ */
+struct cache_header {
+	char magic[8];
+	struct cache_key key;
+};
+
+/*
+ * Hash the source image, to tell when it's been replaced.
+ */
+uint64_t cache_hash(const uint8_t *data, size_t size)
+{
+	// FNV-1a, a word at a time; we only need to notice changes, and this
+	// runs over the whole image on every boot
+	uint64_t hash = 0xcbf29ce484222325ull ^ size;
+	size_t i = 0;
+
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		hash = (hash ^ word) * 0x100000001b3ull;
+	}
+	for (; i < size; ++i)
+		hash = (hash ^ data[i]) * 0x100000001b3ull;
+
+	return hash;
+}
+
+/*
+ * Copy the frame cached at 'path' into 'fb', if it was rendered from 'key'.
+ * Returns false, leaving 'fb' untouched, if it's missing or stale.
+ */
+bool cache_load(const char *path, const struct cache_key *key,
+		struct dumb_framebuffer *fb)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	size_t row_size = (size_t)fb->width * fb->cpp;
+	size_t size = sizeof(struct cache_header) + row_size * fb->height;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != size) {
+		close(fd);
+		return false;
+	}
+
+	// Straight from the page cache into the framebuffer
+	uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	const struct cache_header *header = (const struct cache_header *)data;
+	bool ok = memcmp(header->magic, cache_magic, sizeof cache_magic) == 0 &&
+		memcmp(&header->key, key, sizeof *key) == 0;
+
+	if (ok) {
+		const uint8_t *src = data + sizeof *header;
+		if (fb->stride == row_size) {
+			stream_copy(fb->data, src, row_size * fb->height);
+		} else {
+			for (uint32_t y = 0; y < fb->height; ++y)
+				stream_copy(fb->data + (size_t)y * fb->stride, src + y * row_size, row_size);
+		}
+	}
+
+	munmap(data, size);
+	return ok;
+}
+
+/*
+ * Save the 'size' bytes of unpadded rows at 'pixels', rendered from 'key',
+ * to 'path' for next time. They should come from memory, not the mapping
+ * of the framebuffer, which is slow to read. The file is replaced
+ * atomically, so a crash never leaves half a frame.
+ */
+bool cache_store(const char *path, const struct cache_key *key,
+		const uint8_t *pixels, size_t size)
+{
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f) {
+		perror("fopen");
+		return false;
+	}
+
+	struct cache_header header = { .key = *key };
+	memcpy(header.magic, cache_magic, sizeof cache_magic);
+
+	bool ok = fwrite(&header, sizeof header, 1, f) == 1 &&
+		fwrite(pixels, size, 1, f) == 1;
+
+	ok &= fclose(f) == 0;
+	if (!ok || rename(tmp_path, path) < 0) {
+		perror("Writing splash cache");
+		unlink(tmp_path);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,47 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connector.h"
+#include "fb.h"
+
+/*
+ * Everything a framebuffer's pixels were rendered from. A cached frame is
+ * only used if all of it matches, so a new image or mode invalidates it.
+ */
+struct cache_key {
+	uint64_t image_hash; // see cache_hash()
+	uint32_t width;      // of the framebuffer itself, which in compact
+	uint32_t height;     // mode is just the image
+	uint32_t format;
+	uint32_t fill_mode;
+	uint32_t background;
+	uint32_t filter;
+	struct placement splash;
+};
+
+/*
+ * Hash the source image, to tell when it's been replaced.
+ */
+uint64_t cache_hash(const uint8_t *data, size_t size);
+
+/*
+ * Copy the frame cached at 'path' into 'fb', if it was rendered from 'key'.
+ * Returns false, leaving 'fb' untouched, if it's missing or stale.
+ */
+bool cache_load(const char *path, const struct cache_key *key,
+		struct dumb_framebuffer *fb);
+
+/*
+ * Save the 'size' bytes of unpadded rows at 'pixels', rendered from 'key',
+ * to 'path' for next time. They should come from memory, not the mapping
+ * of the framebuffer, which is slow to read. The file is replaced
+ * atomically, so a crash never leaves half a frame.
+ */
+bool cache_store(const char *path, const struct cache_key *key,
+		const uint8_t *pixels, size_t size);
+
+#endif
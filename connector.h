@@ -0,0 +1,101 @@
+#ifndef CONNECTOR_H
+#define CONNECTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "fb.h"
+#include "progress.h"
+#include "stats.h"
+#include "text.h"
+
+/*
+ * Property IDs needed to put a framebuffer on a plane through atomic KMS.
+ */
+struct plane_props {
+	uint32_t fb_id;
+	uint32_t crtc_id;
+	uint32_t src_x, src_y, src_w, src_h;
+	uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+};
+
+/*
+ * Property IDs needed to drive a connector, its CRTC and its planes
+ * through atomic KMS.
+ */
+struct kms_props {
+	uint32_t conn_crtc_id;
+
+	uint32_t crtc_mode_id;
+	uint32_t crtc_active;
+
+	struct plane_props primary;
+	struct plane_props overlay; // only in compact mode
+};
+
+/*
+ * Where the splash image lands on a framebuffer, already clipped to it.
+ * Unless the image is scaled, the source and destination sizes match.
+ */
+struct placement {
+	uint32_t src_x, src_y; // first image pixel that is visible
+	uint32_t src_width, src_height;
+	uint32_t dst_x, dst_y; // where that pixel goes on the framebuffer
+	uint32_t width, height;
+};
+
+struct connector {
+	uint32_t id;
+	char name[16];
+	bool connected;
+
+	drmModeCrtc *saved;
+	uint32_t current_crtc_id; // CRTC driving the connector when we started, if any
+	bool reuse_mode;          // ...already in our mode, so no modeset is needed
+
+	uint32_t crtc_id;
+	uint32_t crtc_index; // position in drmModeRes::crtcs, for possible_crtcs masks
+	drmModeModeInfo mode;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t rate;
+	uint32_t format;       // of the framebuffers, see kms_choose_format()
+	uint16_t *saved_gamma; // ramps replaced by the C8 palette, or NULL
+
+	// Two buffers when animating, flipped between on every vblank
+	struct dumb_framebuffer fb[2];
+	int num_fbs;
+	int front;
+	int pending; // buffer a page flip to is in flight, or -1
+
+	// In compact mode fb[0] only covers the splash image and sits on an
+	// overlay plane at 'plane_x', 'plane_y', while the primary plane
+	// stretches the tiny solid 'background' across the display
+	bool compact;
+	uint32_t plane_x, plane_y;
+	struct dumb_framebuffer background;
+
+	struct placement splash; // relative to fb[0]
+	bool cached;             // ...which came from the splash cache already
+	struct progress_bar bar;
+	bool animating;
+	int progress; // percent, once set over the control socket, or -1
+	bool idle;    // scanning out slowly, see kms_set_idle()
+	struct flip_stats stats;
+
+	// Status message under the bar, kept track of in each framebuffer
+	const struct font_atlas *font; // NULL if it couldn't be rendered
+	struct text_line text[2];
+
+	// Atomic KMS state, unused on the legacy path
+	uint32_t plane_id;
+	uint32_t overlay_id;
+	uint32_t mode_blob;
+	struct kms_props props;
+
+	struct connector *next;
+};
+
+#endif
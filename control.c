@@ -0,0 +1,254 @@
+#define _GNU_SOURCE // accept4()
+
+#include "control.h"
+
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_COMMAND 256
+#define MAX_REPLY 4096
+
+/*
+ * Create and bind the socket at 'path', replacing any stale one.
+ * Clients can connect right away, but are only served once
+ * control_start() has added the socket to an event loop.
+ */
+bool control_init(struct control *control, const char *path,
+		const struct control_handler *handler)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	*control = (struct control) {
+		.path = path,
+		.handler = *handler,
+	};
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; ++i)
+		control->clients[i].source.fd = -1;
+
+	control->source.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control->source.fd < 0) {
+		perror("socket");
+		return false;
+	}
+
+	unlink(path);
+	if (bind(control->source.fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+			listen(control->source.fd, CONTROL_MAX_CLIENTS) < 0) {
+		perror(path);
+		close(control->source.fd);
+		control->source.fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+static void drop_client(struct control_client *client)
+{
+	event_loop_remove(client->control->loop, &client->source);
+	close(client->source.fd);
+	client->source.fd = -1;
+}
+
+static bool parse_number(const char *str, uint64_t max, uint64_t *value)
+{
+	char *end;
+	errno = 0;
+	*value = strtoull(str, &end, 0);
+	return end != str && *end == '\0' && errno == 0 && *value <= max;
+}
+
+/*
+ * Parse "WIDTH HEIGHT FOURCC STRIDE [OFFSET [MODIFIER]]". Without a
+ * modifier, the driver is left to work out the layout itself.
+ */
+static bool parse_dmabuf(char *args, struct dmabuf_frame *frame)
+{
+	char *arg[6];
+	int count = 0;
+	char *save;
+	for (char *tok = strtok_r(args, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+		if (count == 6)
+			return false;
+		arg[count++] = tok;
+	}
+
+	if (count < 4 || strlen(arg[2]) != 4)
+		return false;
+
+	uint64_t width, height, stride, offset = 0;
+	uint64_t modifier = DRM_FORMAT_MOD_INVALID;
+	if (!parse_number(arg[0], UINT16_MAX, &width) || !width ||
+			!parse_number(arg[1], UINT16_MAX, &height) || !height ||
+			!parse_number(arg[3], UINT32_MAX, &stride) ||
+			(count > 4 && !parse_number(arg[4], UINT32_MAX, &offset)) ||
+			(count > 5 && !parse_number(arg[5], UINT64_MAX, &modifier)))
+		return false;
+
+	*frame = (struct dmabuf_frame) {
+		.width = width,
+		.height = height,
+		.format = fourcc_code(arg[2][0], arg[2][1], arg[2][2], arg[2][3]),
+		.stride = stride,
+		.offset = offset,
+		.modifier = modifier,
+	};
+	return true;
+}
+
+static bool run_command(struct control *control, char *cmd, int fd, char *reply, size_t size)
+{
+	const struct control_handler *h = &control->handler;
+
+	// Commands may come from a shell, so allow a trailing newline
+	cmd[strcspn(cmd, "\n")] = '\0';
+
+	if (strncmp(cmd, "progress ", 9) == 0) {
+		char *end;
+		unsigned long percent = strtoul(cmd + 9, &end, 10);
+		if (end == cmd + 9 || *end != '\0' || percent > 100)
+			return false;
+		return h->progress && h->progress(h->data, percent);
+	}
+
+	if (strcmp(cmd, "message") == 0 || strncmp(cmd, "message ", 8) == 0)
+		return h->message && h->message(h->data, cmd[7] ? cmd + 8 : "");
+
+	if (strcmp(cmd, "stats") == 0)
+		return h->stats && h->stats(h->data, reply, size);
+
+	if (strcmp(cmd, "image") == 0)
+		return fd >= 0 && h->image && h->image(h->data, fd);
+
+	if (strncmp(cmd, "dmabuf ", 7) == 0) {
+		struct dmabuf_frame frame;
+		return fd >= 0 && parse_dmabuf(cmd + 7, &frame) &&
+			h->dmabuf && h->dmabuf(h->data, fd, &frame);
+	}
+
+	return false;
+}
+
+static void handle_client(struct event_source *source, uint32_t events)
+{
+	struct control_client *client = (struct control_client *)source;
+
+	char cmd[MAX_COMMAND];
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control_buf;
+
+	struct iovec iov = { .iov_base = cmd, .iov_len = sizeof cmd - 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control_buf.buf,
+		.msg_controllen = sizeof control_buf.buf,
+	};
+
+	ssize_t len = recvmsg(source->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		// The client hung up
+		drop_client(client);
+		return;
+	}
+	cmd[len] = '\0';
+
+	// Every descriptor that came along is ours now, so keep the first one
+	// and close the rest, which also fails the command
+	int fd = -1;
+	bool extra_fds = false;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count; ++i) {
+			int received;
+			memcpy(&received, CMSG_DATA(c) + i * sizeof(int), sizeof received);
+			if (fd < 0) {
+				fd = received;
+			} else {
+				close(received);
+				extra_fds = true;
+			}
+		}
+	}
+
+	// Leave room for the status after whatever the command reports
+	char reply[MAX_REPLY] = "";
+	bool ok = !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) && !extra_fds &&
+		run_command(client->control, cmd, fd, reply, sizeof reply - 8);
+	if (fd >= 0)
+		close(fd);
+
+	if (!ok)
+		reply[0] = '\0';
+	strcat(reply, ok ? "ok\n" : "error\n");
+	send(source->fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void handle_connect(struct event_source *source, uint32_t events)
+{
+	struct control *control = (struct control *)source;
+
+	int fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			perror("accept4");
+		return;
+	}
+
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+		struct control_client *client = &control->clients[i];
+		if (client->source.fd >= 0)
+			continue;
+
+		client->source = (struct event_source) { .fd = fd, .dispatch = handle_client };
+		client->control = control;
+		if (!event_loop_add(control->loop, &client->source)) {
+			client->source.fd = -1;
+			break;
+		}
+		return;
+	}
+
+	// Too many clients, or we couldn't watch this one
+	close(fd);
+}
+
+bool control_start(struct control *control, struct event_loop *loop)
+{
+	control->loop = loop;
+	control->source.dispatch = handle_connect;
+	return event_loop_add(loop, &control->source);
+}
+
+void control_finish(struct control *control)
+{
+	if (control->source.fd < 0)
+		return;
+
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+		if (control->clients[i].source.fd >= 0)
+			close(control->clients[i].source.fd);
+	}
+
+	close(control->source.fd);
+	unlink(control->path);
+}
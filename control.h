@@ -0,0 +1,67 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+#include "fb.h"
+
+#define CONTROL_MAX_CLIENTS 8
+
+/*
+ * What the daemon does with each command. Handlers return false if the
+ * command failed, which is reported back to the client.
+ */
+struct control_handler {
+	bool (*progress)(void *data, uint32_t percent);
+	// 'fd' is only valid during the call
+	bool (*image)(void *data, int fd);
+	bool (*dmabuf)(void *data, int fd, const struct dmabuf_frame *frame);
+	// 'text' is empty to clear the message
+	bool (*message)(void *data, const char *text);
+	// Writes at most 'size' bytes, including the terminating NUL
+	bool (*stats)(void *data, char *reply, size_t size);
+	void *data;
+};
+
+struct control_client {
+	struct event_source source;
+	struct control *control;
+};
+
+/*
+ * A Unix domain SOCK_SEQPACKET socket taking one command per packet:
+ *
+ *   progress PERCENT   show a determinate progress bar
+ *   image              show the image behind the file descriptor sent
+ *                      along with the packet (SCM_RIGHTS), a file or memfd
+ *   dmabuf WIDTH HEIGHT FOURCC STRIDE [OFFSET [MODIFIER]]
+ *                      scan out the dma-buf sent along with the packet,
+ *                      e.g. "dmabuf 1920 1080 XR24 7680"
+ *   message [TEXT]     show TEXT under the progress bar, or clear it
+ *   stats              report page flip timing, one line per display
+ *
+ * Every command is answered with "ok" or "error", after whatever it
+ * reports, in the same packet.
+ */
+struct control {
+	struct event_source source;
+	struct event_loop *loop;
+	const char *path;
+	struct control_handler handler;
+	struct control_client clients[CONTROL_MAX_CLIENTS];
+};
+
+/*
+ * Create and bind the socket at 'path', replacing any stale one.
+ * Clients can connect right away, but are only served once
+ * control_start() has added the socket to an event loop.
+ */
+bool control_init(struct control *control, const char *path,
+		const struct control_handler *handler);
+bool control_start(struct control *control, struct event_loop *loop);
+void control_finish(struct control *control);
+
+#endif
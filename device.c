@@ -0,0 +1,125 @@
+#include "device.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "timing.h"
+#include "util.h"
+
+// More than enough for any board we know of
+#define MAX_DEVICES 16
+
+struct device_job {
+	const char *path;
+	int fd;
+	bool kms;       // has CRTCs and connectors, i.e. can drive displays
+	int connected;  // displays known to be connected right now
+};
+
+static void *probe_device(void *data)
+{
+	struct device_job *job = data;
+
+	uint64_t start = timing_now();
+	job->fd = open(job->path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (job->fd < 0) {
+		perror(job->path);
+		return NULL;
+	}
+
+	// Render-only GPUs fail this or have nothing to drive
+	drmModeRes *res = drmModeGetResources(job->fd);
+	if (!res)
+		return NULL;
+	job->kms = res->count_crtcs > 0 && res->count_connectors > 0;
+
+	// Only look at what the kernel already knows. A full probe can take a
+	// while per connector, and it happens anyway once a device is chosen.
+	for (int i = 0; i < res->count_connectors; ++i) {
+		drmModeConnector *conn = drmModeGetConnectorCurrent(job->fd, res->connectors[i]);
+		if (!conn)
+			continue;
+
+		job->connected += conn->connection == DRM_MODE_CONNECTED;
+		drmModeFreeConnector(conn);
+	}
+
+	drmModeFreeResources(res);
+	timing_record("probe_device", job->path, start);
+	return NULL;
+}
+
+/*
+ * Open the DRM device to light displays on. If 'path' is empty, every
+ * primary node in the system is probed in parallel and the one with the
+ * most connected displays wins; render-only GPUs never do. The chosen
+ * node is written back to 'path', which holds 'size' bytes.
+ * Returns the open device, or -1.
+ */
+int device_open(char *path, size_t size)
+{
+	if (*path) {
+		int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			perror(path);
+		return fd;
+	}
+
+	drmDevice *devices[MAX_DEVICES];
+	int count = drmGetDevices2(0, devices, MAX_DEVICES);
+	if (count <= 0) {
+		fprintf(stderr, "No DRM devices found\n");
+		return -1;
+	}
+
+	// That's how many there are, not how many fit in 'devices'
+	if (count > MAX_DEVICES)
+		count = MAX_DEVICES;
+
+	struct device_job jobs[MAX_DEVICES];
+	int num_jobs = 0;
+	for (int i = 0; i < count; ++i) {
+		if (!(devices[i]->available_nodes & (1 << DRM_NODE_PRIMARY)))
+			continue;
+
+		jobs[num_jobs++] = (struct device_job) {
+			.path = devices[i]->nodes[DRM_NODE_PRIMARY],
+			.fd = -1,
+		};
+	}
+
+	run_parallel(probe_device, jobs, sizeof *jobs, num_jobs);
+
+	// With nothing connected anywhere yet, any device that can drive a
+	// display will do, and the first is as good a guess as any
+	int best = -1;
+	for (int i = 0; i < num_jobs; ++i) {
+		if (!jobs[i].kms)
+			continue;
+
+		if (best < 0 || jobs[i].connected > jobs[best].connected)
+			best = i;
+	}
+
+	int fd = -1;
+	for (int i = 0; i < num_jobs; ++i) {
+		if (i == best) {
+			fd = jobs[i].fd;
+			snprintf(path, size, "%s", jobs[i].path);
+		} else if (jobs[i].fd >= 0) {
+			close(jobs[i].fd);
+		}
+	}
+
+	if (best < 0)
+		fprintf(stderr, "No DRM device can drive a display\n");
+
+	drmFreeDevices(devices, count);
+	return fd;
+}
@@ -0,0 +1,15 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stddef.h>
+
+/*
+ * Open the DRM device to light displays on. If 'path' is empty, every
+ * primary node in the system is probed in parallel and the one with the
+ * most connected displays wins; render-only GPUs never do. The chosen
+ * node is written back to 'path', which holds 'size' bytes.
+ * Returns the open device, or -1.
+ */
+int device_open(char *path, size_t size);
+
+#endif
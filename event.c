@@ -0,0 +1,80 @@
+#include "event.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 8
+
+bool event_loop_init(struct event_loop *loop)
+{
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		perror("epoll_create1");
+		return false;
+	}
+
+	loop->running = true;
+	return true;
+}
+
+void event_loop_finish(struct event_loop *loop)
+{
+	close(loop->epoll_fd);
+}
+
+/*
+ * Start or stop watching 'source->fd' for input.
+ * A dispatch callback may remove its own source, but no other.
+ */
+bool event_loop_add(struct event_loop *loop, struct event_source *source)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = source,
+	};
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	return true;
+}
+
+void event_loop_remove(struct event_loop *loop, struct event_source *source)
+{
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+/*
+ * Sleep until a source becomes readable and dispatch it, until
+ * event_loop_quit() is called. There are no timeouts or periodic wakeups.
+ */
+bool event_loop_run(struct event_loop *loop)
+{
+	struct epoll_event events[MAX_EVENTS];
+
+	while (loop->running) {
+		int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return false;
+		}
+
+		for (int i = 0; i < count && loop->running; ++i) {
+			struct event_source *source = events[i].data.ptr;
+			source->dispatch(source, events[i].events);
+		}
+	}
+
+	return true;
+}
+
+void event_loop_quit(struct event_loop *loop)
+{
+	loop->running = false;
+}
@@ -0,0 +1,44 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct event_source;
+
+typedef void (*event_fn)(struct event_source *source, uint32_t events);
+
+/*
+ * A file descriptor watched by the event loop.
+ * Embed it in a larger struct to carry state into the callback.
+ */
+struct event_source {
+	int fd;
+	event_fn dispatch;
+	void *data;
+};
+
+struct event_loop {
+	int epoll_fd;
+	bool running;
+};
+
+bool event_loop_init(struct event_loop *loop);
+void event_loop_finish(struct event_loop *loop);
+
+/*
+ * Start or stop watching 'source->fd' for input.
+ * A dispatch callback may remove its own source, but no other.
+ */
+bool event_loop_add(struct event_loop *loop, struct event_source *source);
+void event_loop_remove(struct event_loop *loop, struct event_source *source);
+
+/*
+ * Sleep until a source becomes readable and dispatch it, until
+ * event_loop_quit() is called. There are no periodic wakeups; timeouts
+ * are timerfds added like any other source.
+ */
+bool event_loop_run(struct event_loop *loop);
+void event_loop_quit(struct event_loop *loop);
+
+#endif
@@ -0,0 +1,423 @@
+#include "fb.h"
+
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "stream.h"
+#include "timing.h"
+
+/*
+ * Bytes per pixel of 'format': 4 for XRGB8888, 2 for RGB565 and 1 for C8.
+ * Any other format isn't supported and gives 0.
+ */
+uint32_t format_cpp(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_XRGB8888:
+		return 4;
+	case DRM_FORMAT_RGB565:
+		return 2;
+	case DRM_FORMAT_C8:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Human-readable name of 'format', for messages.
+ */
+const char *format_name(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_XRGB8888:
+		return "XRGB8888";
+	case DRM_FORMAT_RGB565:
+		return "RGB565";
+	case DRM_FORMAT_C8:
+		return "C8";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * Convert an XRGB8888 colour to a pixel of 'format'.
+ * C8 pixels index the RGB332 palette from format_palette().
+ */
+uint32_t format_pixel(uint32_t format, uint32_t color)
+{
+	uint32_t r = (color >> 16) & 0xff;
+	uint32_t g = (color >> 8) & 0xff;
+	uint32_t b = color & 0xff;
+
+	switch (format) {
+	case DRM_FORMAT_RGB565:
+		return (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+	case DRM_FORMAT_C8:
+		return (r >> 5) << 5 | (g >> 5) << 2 | b >> 6;
+	default:
+		return color;
+	}
+}
+
+/*
+ * Fill in the 256-entry colour lookup table C8 framebuffers are shown with:
+ * 3 bits each of red and green and 2 bits of blue.
+ */
+void format_palette(uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+	// Spread each field over the full 16-bit range, so white stays white
+	for (uint32_t i = 0; i < 256; ++i) {
+		red[i] = (i >> 5) * 0xffff / 7;
+		green[i] = ((i >> 2) & 7) * 0xffff / 7;
+		blue[i] = (i & 3) * 0xffff / 3;
+	}
+}
+
+/*
+ * Keep a copy of everything written to 'fb' from now on in memory, rows
+ * packed without padding, so it can be saved without reading the mapping
+ * back. It starts out zeroed, as the kernel hands out new buffers.
+ */
+bool fb_start_shadow(struct dumb_framebuffer *fb)
+{
+	fb->shadow = calloc(fb->height, (size_t)fb->width * fb->cpp);
+	if (!fb->shadow) {
+		perror("calloc");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Stop copying what's written to 'fb', and free the copy.
+ */
+void fb_end_shadow(struct dumb_framebuffer *fb)
+{
+	free(fb->shadow);
+	fb->shadow = NULL;
+}
+
+/*
+ * Write 'width' XRGB8888 pixels from 'src' into row 'y' of 'fb', starting
+ * at 'x' and converting them to the framebuffer's format on the way.
+ */
+void fb_write_row(struct dumb_framebuffer *fb, uint32_t x, uint32_t y,
+		const uint32_t *src, uint32_t width)
+{
+	uint8_t *row = fb->data + (size_t)y * fb->stride + (size_t)x * fb->cpp;
+	uint8_t *copy = fb->shadow ? fb->shadow + ((size_t)y * fb->width + x) * fb->cpp : NULL;
+
+	if (fb->format == DRM_FORMAT_XRGB8888) {
+		stream_copy(row, src, (size_t)width * 4);
+		if (copy)
+			memcpy(copy, src, (size_t)width * 4);
+		return;
+	}
+
+	// Pixels are converted into a buffer that stays in the cache, so the
+	// write-combined mapping only ever sees the streaming stores
+	uint16_t chunk[512];
+	uint32_t per_chunk = sizeof chunk / fb->cpp;
+
+	for (uint32_t i = 0; i < width; i += per_chunk) {
+		uint32_t count = width - i < per_chunk ? width - i : per_chunk;
+
+		if (fb->format == DRM_FORMAT_RGB565) {
+			for (uint32_t j = 0; j < count; ++j)
+				chunk[j] = format_pixel(DRM_FORMAT_RGB565, src[i + j]);
+		} else {
+			uint8_t *indices = (uint8_t *)chunk;
+			for (uint32_t j = 0; j < count; ++j)
+				indices[j] = format_pixel(DRM_FORMAT_C8, src[i + j]);
+		}
+
+		stream_copy(row + (size_t)i * fb->cpp, chunk, (size_t)count * fb->cpp);
+		if (copy)
+			memcpy(copy + (size_t)i * fb->cpp, chunk, (size_t)count * fb->cpp);
+	}
+}
+
+/*
+ * Paint a 'width' x 'height' rectangle of 'fb' at 'x', 'y' with 'color'.
+ * The rectangle must lie within the framebuffer. 'color' is XRGB8888.
+ */
+void fill_rect(struct dumb_framebuffer *fb, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, uint32_t color)
+{
+	uint32_t pixel = format_pixel(fb->format, color);
+	uint32_t pattern = fb->cpp == 1 ? pixel * 0x01010101u
+		: fb->cpp == 2 ? pixel * 0x00010001u : pixel;
+	size_t row_size = (size_t)width * fb->cpp;
+	uint8_t *line = fb->data + (size_t)y * fb->stride + (size_t)x * fb->cpp;
+
+	if (fb->shadow) {
+		uint8_t *copy = fb->shadow + ((size_t)y * fb->width + x) * fb->cpp;
+		for (uint32_t row = 0; row < height; ++row, copy += (size_t)fb->width * fb->cpp) {
+			for (uint32_t i = 0; i < width; ++i)
+				memcpy(copy + (size_t)i * fb->cpp, &pattern, fb->cpp);
+		}
+	}
+
+	// Whole rows of an unpadded buffer are one contiguous fill
+	if (row_size == fb->stride) {
+		stream_fill(line, pattern, row_size * height);
+		return;
+	}
+
+	for (uint32_t row = 0; row < height; ++row, line += fb->stride)
+		stream_fill(line, pattern, row_size);
+}
+
+/*
+ * Apply 'fill' to a framebuffer, before an image is written to it.
+ * The mapping is usually write-combined, so we only touch every byte once
+ * and never paint what the image is about to overwrite anyway.
+ */
+void fill_fb(struct dumb_framebuffer *fb, const struct fill_policy *fill)
+{
+	switch (fill->mode) {
+	case FILL_NONE:
+		break;
+	case FILL_SOLID:
+		fill_rect(fb, 0, 0, fb->width, fb->height, fill->color);
+		break;
+	case FILL_MARGINS: {
+		uint32_t x0 = fill->x < fb->width ? fill->x : fb->width;
+		uint32_t y0 = fill->y < fb->height ? fill->y : fb->height;
+		uint32_t x1 = fill->width < fb->width - x0 ? x0 + fill->width : fb->width;
+		uint32_t y1 = fill->height < fb->height - y0 ? y0 + fill->height : fb->height;
+
+		fill_rect(fb, 0, 0, fb->width, y0, fill->color);
+		fill_rect(fb, 0, y0, x0, y1 - y0, fill->color);
+		fill_rect(fb, x1, y0, fb->width - x1, y1 - y0, fill->color);
+		fill_rect(fb, 0, y1, fb->width, fb->height - y1, fill->color);
+		break;
+	}
+	}
+}
+
+/*
+ * Allocate a dumb buffer, register it as a framebuffer of 'format' and map it.
+ * 'fill' decides which parts of it are painted before the image goes in.
+ */
+bool create_fb(int drm_fd, uint32_t width, uint32_t height, uint32_t format,
+		const struct fill_policy *fill, struct dumb_framebuffer *fb)
+{
+	int ret;
+	char size[24];
+	snprintf(size, sizeof size, "%"PRIu32"x%"PRIu32, width, height);
+
+	uint64_t start = timing_now();
+	struct drm_mode_create_dumb create = {
+		.width = width,
+		.height = height,
+		.bpp = format_cpp(format) * 8,
+	};
+
+	ret = drmIoctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+	if (ret < 0) {
+		perror("DRM_IOCTL_MODE_CREATE_DUMB");
+		return false;
+	}
+	timing_record("fb.create_dumb", size, start);
+
+	fb->height = height;
+	fb->width = width;
+	fb->stride = create.pitch;
+	fb->format = format;
+	fb->cpp = format_cpp(format);
+	fb->handle = create.handle;
+	fb->size = create.size;
+	fb->shadow = NULL;
+
+	uint32_t handles[4] = { fb->handle };
+	uint32_t strides[4] = { fb->stride };
+	uint32_t offsets[4] = { 0 };
+
+	start = timing_now();
+	ret = drmModeAddFB2(drm_fd, width, height, format,
+			handles, strides, offsets, &fb->id, 0);
+	if (ret < 0) {
+		perror("drmModeAddFB2");
+		goto error_dumb;
+	}
+	timing_record("fb.add_fb", size, start);
+
+	start = timing_now();
+	struct drm_mode_map_dumb map = { .handle = fb->handle };
+	ret = drmIoctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map);
+	if (ret < 0) {
+		perror("DRM_IOCTL_MODE_MAP_DUMB");
+		goto error_fb;
+	}
+
+	fb->data = mmap(0, fb->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			drm_fd, map.offset);
+	if (fb->data == MAP_FAILED) {
+		perror("mmap");
+		goto error_fb;
+	}
+	timing_record("fb.map", size, start);
+
+	start = timing_now();
+	fill_fb(fb, fill);
+	timing_record("fb.fill", size, start);
+
+	return true;
+
+error_fb:
+	drmModeRmFB(drm_fd, fb->id);
+error_dumb:
+	;
+	struct drm_mode_destroy_dumb destroy = { .handle = fb->handle };
+	drmIoctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	return false;
+}
+
+/*
+ * Tell the driver which 'count' rectangles of 'fb' changed since it was
+ * last shown. Drivers that have to upload the framebuffer to the display,
+ * e.g. over USB or SPI, then only send those; the rest ignore it.
+ */
+void fb_flush(int drm_fd, const struct dumb_framebuffer *fb, drmModeClip *clips,
+		uint32_t count)
+{
+	// Scanning straight out of memory, there's nothing to flush
+	int ret = drmModeDirtyFB(drm_fd, fb->id, clips, count);
+	if (ret < 0 && ret != -ENOSYS && ret != -EOPNOTSUPP) {
+		errno = -ret;
+		perror("drmModeDirtyFB");
+	}
+}
+
+/*
+ * Close the GEM 'handle' of an imported dma-buf, unless 'other' (which may
+ * be NULL) still has a framebuffer on it.
+ */
+static void close_handle(int drm_fd, uint32_t handle, const struct imported_fb *other)
+{
+	if (other && other->id && other->handle == handle)
+		return;
+
+	struct drm_gem_close gem_close = { .handle = handle };
+	drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+}
+
+/*
+ * Register the dma-buf 'dmabuf_fd' as a framebuffer, without copying it.
+ * 'dmabuf_fd' can be closed afterwards. Importing the dma-buf behind
+ * 'shown' (which may be NULL) again gives the same GEM handle, which is
+ * then left to 'shown' if this fails.
+ */
+bool import_fb(int drm_fd, int dmabuf_fd, const struct dmabuf_frame *frame,
+		const struct imported_fb *shown, struct imported_fb *fb)
+{
+	if (drmPrimeFDToHandle(drm_fd, dmabuf_fd, &fb->handle) < 0) {
+		perror("drmPrimeFDToHandle");
+		return false;
+	}
+
+	uint32_t handles[4] = { fb->handle };
+	uint32_t strides[4] = { frame->stride };
+	uint32_t offsets[4] = { frame->offset };
+	uint64_t modifiers[4] = { frame->modifier };
+
+	// Without modifiers the driver would guess the layout, which is only
+	// right for linear buffers
+	int ret;
+	const char *call;
+	if (frame->modifier == DRM_FORMAT_MOD_INVALID) {
+		call = "drmModeAddFB2";
+		ret = drmModeAddFB2(drm_fd, frame->width, frame->height, frame->format,
+				handles, strides, offsets, &fb->id, 0);
+	} else {
+		call = "drmModeAddFB2WithModifiers";
+		ret = drmModeAddFB2WithModifiers(drm_fd, frame->width, frame->height,
+				frame->format, handles, strides, offsets, modifiers, &fb->id,
+				DRM_MODE_FB_MODIFIERS);
+	}
+	if (ret < 0) {
+		perror(call);
+		close_handle(drm_fd, fb->handle, shown);
+		fb->id = 0;
+		return false;
+	}
+
+	fb->width = frame->width;
+	fb->height = frame->height;
+	return true;
+}
+
+/*
+ * Release a framebuffer made by import_fb(). The dma-buf itself lives on
+ * for as long as its producer holds on to it. The GEM handle stays open
+ * if 'other' (which may be NULL) is a framebuffer of the same dma-buf.
+ */
+void destroy_imported_fb(int drm_fd, struct imported_fb *fb,
+		const struct imported_fb *other)
+{
+	drmModeRmFB(drm_fd, fb->id);
+	close_handle(drm_fd, fb->handle, other);
+	fb->id = 0;
+}
+
+static bool close_fb(int drm_fd, uint32_t fb_id)
+{
+#ifdef DRM_IOCTL_MODE_CLOSEFB
+	// Unlike RmFB, this doesn't take the framebuffer off the planes using it
+	struct drm_mode_closefb closefb = { .fb_id = fb_id };
+	return drmIoctl(drm_fd, DRM_IOCTL_MODE_CLOSEFB, &closefb) == 0;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Like destroy_fb() and destroy_imported_fb(), but if the framebuffer is
+ * on screen, it stays there until someone else replaces it. This needs
+ * DRM_IOCTL_MODE_CLOSEFB (Linux 6.8); without it nothing is freed and
+ * false is returned.
+ */
+bool release_fb(int drm_fd, struct dumb_framebuffer *fb)
+{
+	if (!close_fb(drm_fd, fb->id))
+		return false;
+
+	// The framebuffer holds its own reference to the buffer
+	munmap(fb->data, fb->size);
+	struct drm_mode_destroy_dumb destroy = { .handle = fb->handle };
+	drmIoctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	return true;
+}
+
+bool release_imported_fb(int drm_fd, struct imported_fb *fb)
+{
+	if (!close_fb(drm_fd, fb->id))
+		return false;
+
+	struct drm_gem_close gem_close = { .handle = fb->handle };
+	drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	fb->id = 0;
+	return true;
+}
+
+/*
+ * Unmap and free a framebuffer made by create_fb().
+ */
+void destroy_fb(int drm_fd, struct dumb_framebuffer *fb)
+{
+	munmap(fb->data, fb->size);
+	drmModeRmFB(drm_fd, fb->id);
+	struct drm_mode_destroy_dumb destroy = { .handle = fb->handle };
+	drmIoctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+}
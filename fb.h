@@ -0,0 +1,161 @@
+#ifndef FB_H
+#define FB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+struct dumb_framebuffer {
+	uint32_t id;     // DRM object ID
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format; // DRM fourcc, see format_cpp() for the ones we support
+	uint32_t cpp;    // bytes per pixel
+	uint32_t handle; // driver-specific handle
+	uint64_t size;   // size of mapping
+
+	uint8_t *data;   // mmapped data we can write to
+	uint8_t *shadow; // unpadded copy of what's written, see fb_start_shadow()
+};
+
+/*
+ * A single-plane dma-buf frame, as described by whoever produced it.
+ */
+struct dmabuf_frame {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format; // DRM fourcc
+	uint32_t stride;
+	uint32_t offset;
+	uint64_t modifier;
+};
+
+/*
+ * A framebuffer around someone else's dma-buf, scanned out as it is.
+ */
+struct imported_fb {
+	uint32_t id;     // DRM object ID, or 0
+	uint32_t handle; // our GEM handle for the dma-buf
+	uint32_t width;
+	uint32_t height;
+};
+
+enum fill_mode {
+	FILL_NONE,    // leave the buffer as the kernel handed it to us (zeroed)
+	FILL_SOLID,   // paint the whole buffer
+	FILL_MARGINS, // paint only the area the image won't cover
+};
+
+struct fill_policy {
+	enum fill_mode mode;
+	uint32_t color; // XRGB8888, converted to the framebuffer's format
+
+	// Area the image will be written to, used by FILL_MARGINS
+	uint32_t x, y;
+	uint32_t width, height;
+};
+
+/*
+ * Bytes per pixel of 'format': 4 for XRGB8888, 2 for RGB565 and 1 for C8.
+ * Any other format isn't supported and gives 0.
+ */
+uint32_t format_cpp(uint32_t format);
+
+/*
+ * Human-readable name of 'format', for messages.
+ */
+const char *format_name(uint32_t format);
+
+/*
+ * Convert an XRGB8888 colour to a pixel of 'format'.
+ * C8 pixels index the RGB332 palette from format_palette().
+ */
+uint32_t format_pixel(uint32_t format, uint32_t color);
+
+/*
+ * Fill in the 256-entry colour lookup table C8 framebuffers are shown with:
+ * 3 bits each of red and green and 2 bits of blue.
+ */
+void format_palette(uint16_t *red, uint16_t *green, uint16_t *blue);
+
+/*
+ * Keep a copy of everything written to 'fb' from now on in memory, rows
+ * packed without padding, so it can be saved without reading the mapping
+ * back. It starts out zeroed, as the kernel hands out new buffers.
+ */
+bool fb_start_shadow(struct dumb_framebuffer *fb);
+
+/*
+ * Stop copying what's written to 'fb', and free the copy.
+ */
+void fb_end_shadow(struct dumb_framebuffer *fb);
+
+/*
+ * Write 'width' XRGB8888 pixels from 'src' into row 'y' of 'fb', starting
+ * at 'x' and converting them to the framebuffer's format on the way.
+ */
+void fb_write_row(struct dumb_framebuffer *fb, uint32_t x, uint32_t y,
+		const uint32_t *src, uint32_t width);
+
+/*
+ * Paint a 'width' x 'height' rectangle of 'fb' at 'x', 'y' with 'color'.
+ * The rectangle must lie within the framebuffer. 'color' is XRGB8888.
+ */
+void fill_rect(struct dumb_framebuffer *fb, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, uint32_t color);
+
+/*
+ * Apply 'fill' to a framebuffer, before an image is written to it.
+ * The mapping is usually write-combined, so we only touch every byte once
+ * and never paint what the image is about to overwrite anyway.
+ */
+void fill_fb(struct dumb_framebuffer *fb, const struct fill_policy *fill);
+
+/*
+ * Allocate a dumb buffer, register it as a framebuffer of 'format' and map it.
+ * 'fill' decides which parts of it are painted before the image goes in.
+ */
+bool create_fb(int drm_fd, uint32_t width, uint32_t height, uint32_t format,
+		const struct fill_policy *fill, struct dumb_framebuffer *fb);
+
+/*
+ * Tell the driver which 'count' rectangles of 'fb' changed since it was
+ * last shown. Drivers that have to upload the framebuffer to the display,
+ * e.g. over USB or SPI, then only send those; the rest ignore it.
+ */
+void fb_flush(int drm_fd, const struct dumb_framebuffer *fb, drmModeClip *clips,
+		uint32_t count);
+
+/*
+ * Register the dma-buf 'dmabuf_fd' as a framebuffer, without copying it.
+ * 'dmabuf_fd' can be closed afterwards. Importing the dma-buf behind
+ * 'shown' (which may be NULL) again gives the same GEM handle, which is
+ * then left to 'shown' if this fails.
+ */
+bool import_fb(int drm_fd, int dmabuf_fd, const struct dmabuf_frame *frame,
+		const struct imported_fb *shown, struct imported_fb *fb);
+
+/*
+ * Release a framebuffer made by import_fb(). The dma-buf itself lives on
+ * for as long as its producer holds on to it. The GEM handle stays open
+ * if 'other' (which may be NULL) is a framebuffer of the same dma-buf.
+ */
+void destroy_imported_fb(int drm_fd, struct imported_fb *fb,
+		const struct imported_fb *other);
+
+/*
+ * Like destroy_fb() and destroy_imported_fb(), but if the framebuffer is
+ * on screen, it stays there until someone else replaces it. This needs
+ * DRM_IOCTL_MODE_CLOSEFB (Linux 6.8); without it nothing is freed and
+ * false is returned.
+ */
+bool release_fb(int drm_fd, struct dumb_framebuffer *fb);
+bool release_imported_fb(int drm_fd, struct imported_fb *fb);
+
+/*
+ * Unmap and free a framebuffer made by create_fb().
+ */
+void destroy_fb(int drm_fd, struct dumb_framebuffer *fb);
+
+#endif
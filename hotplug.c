@@ -0,0 +1,121 @@
+#include "hotplug.h"
+
+#include <errno.h>
+#include <linux/netlink.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+// The kernel's own uevents, as opposed to udev's rebroadcasts
+#define UEVENT_GROUP_KERNEL 1
+
+#define MAX_UEVENT 8192
+
+/*
+ * Find "key=value" among the NUL-separated fields of a uevent.
+ */
+static const char *uevent_get(const char *buf, size_t len, const char *key)
+{
+	size_t key_len = strlen(key);
+
+	for (size_t i = 0; i < len; i += strlen(buf + i) + 1) {
+		if (strncmp(buf + i, key, key_len) == 0 && buf[i + key_len] == '=')
+			return buf + i + key_len + 1;
+	}
+
+	return NULL;
+}
+
+static void handle_uevent(struct event_source *source, uint32_t events)
+{
+	struct hotplug *hotplug = (struct hotplug *)source;
+
+	char buf[MAX_UEVENT];
+	struct sockaddr_nl addr;
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof buf - 1 };
+	struct msghdr msg = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof addr,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	ssize_t len = recvmsg(source->fd, &msg, 0);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			perror("recvmsg uevent");
+		return;
+	}
+
+	// Only the kernel gets to tell us about hotplug
+	if (addr.nl_pid != 0)
+		return;
+	buf[len] = '\0';
+
+	const char *subsystem = uevent_get(buf, len, "SUBSYSTEM");
+	const char *hotplug_flag = uevent_get(buf, len, "HOTPLUG");
+	const char *major = uevent_get(buf, len, "MAJOR");
+	const char *minor = uevent_get(buf, len, "MINOR");
+	if (!subsystem || strcmp(subsystem, "drm") != 0 || !hotplug_flag ||
+			strcmp(hotplug_flag, "1") != 0 || !major || !minor)
+		return;
+
+	if (makedev(strtoul(major, NULL, 10), strtoul(minor, NULL, 10)) != hotplug->devnum)
+		return;
+
+	// Newer kernels name the connector that changed
+	const char *connector = uevent_get(buf, len, "CONNECTOR");
+	hotplug->changed(hotplug->data, connector ? strtoul(connector, NULL, 10) : 0);
+}
+
+/*
+ * Start listening for hotplug events of the device 'drm_fd' is open on.
+ * Events are only handled once 'hotplug->source' is in an event loop.
+ */
+bool hotplug_init(struct hotplug *hotplug, int drm_fd, hotplug_fn changed, void *data)
+{
+	struct stat st;
+	if (fstat(drm_fd, &st) < 0) {
+		perror("fstat");
+		return false;
+	}
+
+	*hotplug = (struct hotplug) {
+		.source.dispatch = handle_uevent,
+		.devnum = st.st_rdev,
+		.changed = changed,
+		.data = data,
+	};
+
+	// Straight from the kernel rather than through libudev, so this works
+	// from early boot, before udevd is even running
+	hotplug->source.fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (hotplug->source.fd < 0) {
+		perror("socket");
+		return false;
+	}
+
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = UEVENT_GROUP_KERNEL,
+	};
+	if (bind(hotplug->source.fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		perror("bind uevent socket");
+		close(hotplug->source.fd);
+		hotplug->source.fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+void hotplug_finish(struct hotplug *hotplug)
+{
+	if (hotplug->source.fd >= 0)
+		close(hotplug->source.fd);
+}
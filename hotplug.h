@@ -0,0 +1,33 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "event.h"
+
+/*
+ * Called for every hotplug event of the device. 'connector_id' is the
+ * connector that changed, or 0 if the kernel didn't say which.
+ */
+typedef void (*hotplug_fn)(void *data, uint32_t connector_id);
+
+/*
+ * Kernel uevents about connectors of one DRM device coming and going.
+ */
+struct hotplug {
+	struct event_source source;
+	dev_t devnum;
+	hotplug_fn changed;
+	void *data;
+};
+
+/*
+ * Start listening for hotplug events of the device 'drm_fd' is open on.
+ * Events are only handled once 'hotplug->source' is in an event loop.
+ */
+bool hotplug_init(struct hotplug *hotplug, int drm_fd, hotplug_fn changed, void *data);
+void hotplug_finish(struct hotplug *hotplug);
+
+#endif
@@ -0,0 +1,430 @@
+#include "image.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Initial staging buffer size when the input size is not known up front
+#define INITIAL_CAPACITY (8u << 20)
+
+/*
+ * Read the whole splash image from 'fd' into a heap staging buffer.
+ * This is done once, no matter how many displays are lit.
+ */
+bool image_read_fd(int fd, struct image *img)
+{
+	size_t capacity = INITIAL_CAPACITY;
+	size_t total_read = 0;
+
+	// If we were handed a regular file, we know exactly how much to allocate.
+	// The extra byte lets us see EOF without growing the buffer.
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		capacity = st.st_size + 1;
+
+	uint8_t *data = malloc(capacity);
+	if (!data) {
+		perror("malloc");
+		return false;
+	}
+
+	while (true) {
+		if (total_read == capacity) {
+			uint8_t *tmp = realloc(data, capacity * 2);
+			if (!tmp) {
+				perror("realloc");
+				free(data);
+				return false;
+			}
+			data = tmp;
+			capacity *= 2;
+		}
+
+		ssize_t bytes_read = read(fd, data + total_read, capacity - total_read);
+		if (bytes_read < 0) {
+			perror("read splash image");
+			free(data);
+			return false;
+		}
+		if (bytes_read == 0) {
+			// EOF reached
+			break;
+		}
+
+		total_read += bytes_read;
+	}
+
+	img->data = data;
+	img->size = total_read;
+	img->mapped = false;
+	return true;
+}
+
+/*
+ * Map the splash image file at 'path' directly into memory.
+ * No copy is made; the page cache backs the image.
+ */
+bool image_map_file(const char *path, struct image *img)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return false;
+	}
+
+	if (st.st_size == 0) {
+		fprintf(stderr, "%s: empty file\n", path);
+		close(fd);
+		return false;
+	}
+
+	bool ok = image_map_fd(fd, img);
+	close(fd);
+	return ok;
+}
+
+#ifdef EMBEDDED_IMAGE
+// The assembler pulls the file in at build time, so it ends up in .rodata
+// like any other constant, without a conversion step in between
+__asm__(
+	"	.section .rodata\n"
+	"	.balign 16\n"
+	"embedded_image_start:\n"
+	"	.incbin \"" EMBEDDED_IMAGE "\"\n"
+	"embedded_image_end:\n"
+	"	.previous\n"
+);
+
+extern const uint8_t embedded_image_start[];
+extern const uint8_t embedded_image_end[];
+#endif
+
+/*
+ * Use the image built into the binary with -DEMBEDDED_IMAGE='"path"', if
+ * there is one. It's used in place, so nothing is read or copied.
+ */
+bool image_embedded(struct image *img)
+{
+#ifdef EMBEDDED_IMAGE
+	*img = (struct image) {
+		.data = (uint8_t *)embedded_image_start,
+		.size = embedded_image_end - embedded_image_start,
+		.embedded = true,
+	};
+	return img->size > 0;
+#else
+	(void)img;
+	return false;
+#endif
+}
+
+/*
+ * Map the image behind 'fd', e.g. one passed over the control socket.
+ * Anything that can't be mapped, like a pipe, is read instead.
+ * 'fd' stays open and can be closed once this returns.
+ */
+bool image_map_fd(int fd, struct image *img)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return image_read_fd(fd, img);
+
+	// We read the file exactly once, front to back, so prefault it all
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if (data == MAP_FAILED)
+		return image_read_fd(fd, img);
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	img->data = data;
+	img->size = st.st_size;
+	img->mapped = true;
+	return true;
+}
+
+static uint32_t read_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+
+static const uint8_t qoi_magic[4] = { 'q', 'o', 'i', 'f' };
+static const uint8_t png_magic[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+/*
+ * Detect the format of a loaded image and parse its header.
+ * Anything that isn't a known compressed format is taken as raw.
+ */
+bool image_probe(struct image *img)
+{
+	img->format = IMAGE_FORMAT_RAW;
+	img->width = 0;
+	img->height = 0;
+
+	if (img->size >= QOI_HEADER_SIZE && memcmp(img->data, qoi_magic, 4) == 0) {
+		img->format = IMAGE_FORMAT_QOI;
+		img->width = read_be32(img->data + 4);
+		img->height = read_be32(img->data + 8);
+	} else if (img->size >= 24 && memcmp(img->data, png_magic, 8) == 0) {
+		// The IHDR chunk always comes first
+		if (memcmp(img->data + 12, "IHDR", 4) != 0) {
+			fprintf(stderr, "PNG is missing its IHDR chunk\n");
+			return false;
+		}
+		img->format = IMAGE_FORMAT_PNG;
+		img->width = read_be32(img->data + 16);
+		img->height = read_be32(img->data + 20);
+	} else {
+		return true;
+	}
+
+	if (img->width == 0 || img->height == 0 || img->width > 16384 || img->height > 16384) {
+		fprintf(stderr, "Unsupported image size %"PRIu32"x%"PRIu32"\n",
+				img->width, img->height);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Streaming QOI decoder, see https://qoiformat.org/qoi-specification.pdf
+ */
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+
+static bool decode_qoi(const struct image *img, uint32_t *row,
+		image_row_fn fn, void *user_data)
+{
+	const uint8_t *p = img->data + QOI_HEADER_SIZE;
+	const uint8_t *end = img->data + img->size - QOI_PADDING_SIZE;
+
+	uint8_t index[64][4] = { 0 };
+	uint8_t r = 0, g = 0, b = 0, a = 255;
+	uint32_t run = 0;
+
+	for (uint32_t y = 0; y < img->height; ++y) {
+		for (uint32_t x = 0; x < img->width; ++x) {
+			if (run > 0) {
+				run--;
+			} else {
+				if (p >= end)
+					goto truncated;
+
+				uint8_t op = *p++;
+				if (op == QOI_OP_RGB) {
+					if (end - p < 3)
+						goto truncated;
+					r = p[0];
+					g = p[1];
+					b = p[2];
+					p += 3;
+				} else if (op == QOI_OP_RGBA) {
+					if (end - p < 4)
+						goto truncated;
+					r = p[0];
+					g = p[1];
+					b = p[2];
+					a = p[3];
+					p += 4;
+				} else if ((op & QOI_MASK_2) == QOI_OP_INDEX) {
+					r = index[op][0];
+					g = index[op][1];
+					b = index[op][2];
+					a = index[op][3];
+				} else if ((op & QOI_MASK_2) == QOI_OP_DIFF) {
+					r += ((op >> 4) & 0x03) - 2;
+					g += ((op >> 2) & 0x03) - 2;
+					b += (op & 0x03) - 2;
+				} else if ((op & QOI_MASK_2) == QOI_OP_LUMA) {
+					if (p >= end)
+						goto truncated;
+					int dg = (op & 0x3f) - 32;
+					uint8_t next = *p++;
+					r += dg - 8 + ((next >> 4) & 0x0f);
+					g += dg;
+					b += dg - 8 + (next & 0x0f);
+				} else {
+					run = op & 0x3f;
+				}
+
+				uint8_t *slot = index[(r * 3 + g * 5 + b * 7 + a * 11) % 64];
+				slot[0] = r;
+				slot[1] = g;
+				slot[2] = b;
+				slot[3] = a;
+			}
+
+			row[x] = 0xff000000 | (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+		}
+
+		fn(user_data, y, row);
+	}
+
+	return true;
+
+truncated:
+	fprintf(stderr, "QOI image is truncated\n");
+	return false;
+}
+
+/*
+ * libpng reads through this cursor over the in-memory file.
+ */
+struct png_cursor {
+	const uint8_t *data;
+	size_t size;
+	size_t offset;
+};
+
+static void png_read_mem(png_structp png, png_bytep out, png_size_t len)
+{
+	struct png_cursor *cur = png_get_io_ptr(png);
+
+	if (len > cur->size - cur->offset)
+		png_error(png, "image is truncated");
+
+	memcpy(out, cur->data + cur->offset, len);
+	cur->offset += len;
+}
+
+static bool decode_png(const struct image *img, uint32_t *row,
+		image_row_fn fn, void *user_data)
+{
+	struct png_cursor cur = { .data = img->data, .size = img->size };
+
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png)
+		return false;
+
+	png_infop info = png_create_info_struct(png);
+	if (!info) {
+		png_destroy_read_struct(&png, NULL, NULL);
+		return false;
+	}
+
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, &info, NULL);
+		return false;
+	}
+
+	png_set_read_fn(png, &cur, png_read_mem);
+	png_read_info(png, info);
+
+	if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+		// Adam7 needs the whole image before any row is complete
+		fprintf(stderr, "Interlaced PNG images are not supported\n");
+		png_destroy_read_struct(&png, &info, NULL);
+		return false;
+	}
+
+	// Whatever the source layout, have libpng hand us XRGB8888 rows
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_strip_alpha(png);
+	png_set_gray_to_rgb(png);
+	png_set_bgr(png);
+	png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+	png_read_update_info(png, info);
+
+	for (uint32_t y = 0; y < img->height; ++y) {
+		png_read_row(png, (png_bytep)row, NULL);
+		fn(user_data, y, row);
+	}
+
+	png_destroy_read_struct(&png, &info, NULL);
+	return true;
+}
+
+/*
+ * Decode a compressed image one row at a time, handing each row to 'fn'.
+ * Only a single row is ever buffered, never the whole image.
+ */
+bool image_decode(const struct image *img, image_row_fn fn, void *user_data)
+{
+	uint32_t *row = malloc((size_t)img->width * sizeof *row);
+	if (!row) {
+		perror("malloc");
+		return false;
+	}
+
+	bool ok = false;
+	switch (img->format) {
+	case IMAGE_FORMAT_QOI:
+		ok = decode_qoi(img, row, fn, user_data);
+		break;
+	case IMAGE_FORMAT_PNG:
+		ok = decode_png(img, row, fn, user_data);
+		break;
+	case IMAGE_FORMAT_RAW:
+		fprintf(stderr, "Raw images have no header to decode\n");
+		break;
+	}
+
+	free(row);
+	return ok;
+}
+
+static void store_row(void *user_data, uint32_t y, const uint32_t *row)
+{
+	const struct image *img = ((void **)user_data)[0];
+	uint32_t *pixels = ((void **)user_data)[1];
+
+	memcpy(pixels + (size_t)y * img->width, row, img->width * sizeof *row);
+}
+
+/*
+ * Decode a compressed image into a packed heap buffer of width x height
+ * pixels, for consumers that need random access such as the scaler.
+ */
+uint32_t *image_decode_pixels(const struct image *img)
+{
+	uint32_t *pixels = malloc((size_t)img->width * img->height * sizeof *pixels);
+	if (!pixels) {
+		perror("malloc");
+		return NULL;
+	}
+
+	void *ctx[2] = { (void *)img, pixels };
+	if (!image_decode(img, store_row, ctx)) {
+		free(pixels);
+		return NULL;
+	}
+
+	return pixels;
+}
+
+/*
+ * Release the staging buffer of 'img'.
+ */
+void image_finish(struct image *img)
+{
+	if (img->mapped)
+		munmap(img->data, img->size);
+	else if (!img->embedded)
+		free(img->data);
+	free(img->pixels);
+	img->pixels = NULL;
+	img->data = NULL;
+	img->size = 0;
+}
@@ -0,0 +1,90 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum image_format {
+	IMAGE_FORMAT_RAW, // packed XRGB8888 at the display's resolution
+	IMAGE_FORMAT_QOI,
+	IMAGE_FORMAT_PNG,
+};
+
+/*
+ * A splash image staged in memory, shared by every connector.
+ * 'data' holds the file as it was read; compressed formats are decoded
+ * on the fly with image_decode().
+ */
+struct image {
+	uint8_t *data;
+	size_t size;
+	bool mapped;   // data is a read-only file mapping rather than heap memory
+	bool embedded; // ...or built into the binary, see image_embedded()
+
+	enum image_format format;
+	// From the image header. Raw images have no header, so these are 0
+	// and the image is assumed to match the display.
+	uint32_t width;
+	uint32_t height;
+
+	// From image_decode_pixels(), if the caller decoded it ahead of time.
+	// Freed along with the image.
+	uint32_t *pixels;
+};
+
+/*
+ * Called by image_decode() for every decoded row, top to bottom.
+ * 'row' holds img->width XRGB8888 pixels and is only valid during the call.
+ */
+typedef void (*image_row_fn)(void *user_data, uint32_t y, const uint32_t *row);
+
+/*
+ * Read the whole splash image from 'fd' into a heap staging buffer.
+ * This is done once, no matter how many displays are lit.
+ */
+bool image_read_fd(int fd, struct image *img);
+
+/*
+ * Map the splash image file at 'path' directly into memory.
+ * No copy is made; the page cache backs the image.
+ */
+bool image_map_file(const char *path, struct image *img);
+
+/*
+ * Use the image built into the binary with -DEMBEDDED_IMAGE='"path"', if
+ * there is one. It's used in place, so nothing is read or copied.
+ */
+bool image_embedded(struct image *img);
+
+/*
+ * Map the image behind 'fd', e.g. one passed over the control socket.
+ * Anything that can't be mapped, like a pipe, is read instead.
+ * 'fd' stays open and can be closed once this returns.
+ */
+bool image_map_fd(int fd, struct image *img);
+
+/*
+ * Detect the format of a loaded image and parse its header.
+ * Anything that isn't a known compressed format is taken as raw.
+ */
+bool image_probe(struct image *img);
+
+/*
+ * Decode a compressed image one row at a time, handing each row to 'fn'.
+ * Only a single row is ever buffered, never the whole image.
+ */
+bool image_decode(const struct image *img, image_row_fn fn, void *user_data);
+
+/*
+ * Decode a compressed image into a packed heap buffer of width x height
+ * pixels, for consumers that need random access such as the scaler.
+ */
+uint32_t *image_decode_pixels(const struct image *img);
+
+/*
+ * Release the staging buffer of 'img'.
+ */
+void image_finish(struct image *img);
+
+#endif
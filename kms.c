@@ -0,0 +1,919 @@
+#include "kms.h"
+
+#include <drm_fourcc.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "util.h"
+
+struct prop_lookup {
+	const char *name;
+	uint32_t *id;
+};
+
+/*
+ * Fill in the ID of every property in 'lookup' for the given object.
+ * Fails if any of them is missing.
+ */
+static bool get_props(int drm_fd, uint32_t obj_id, uint32_t obj_type,
+		struct prop_lookup *lookup, int count)
+{
+	drmModeObjectProperties *props = drmModeObjectGetProperties(drm_fd, obj_id, obj_type);
+	if (!props)
+		return false;
+
+	for (int i = 0; i < count; ++i)
+		*lookup[i].id = 0;
+
+	for (uint32_t i = 0; i < props->count_props; ++i) {
+		drmModePropertyRes *prop = drmModeGetProperty(drm_fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		for (int j = 0; j < count; ++j) {
+			if (strcmp(prop->name, lookup[j].name) == 0)
+				*lookup[j].id = prop->prop_id;
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	for (int i = 0; i < count; ++i) {
+		if (!*lookup[i].id) {
+			fprintf(stderr, "Object %"PRIu32" has no \"%s\" property\n",
+					obj_id, lookup[i].name);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Read the current value of the property called 'name' of an object.
+ */
+static bool get_prop_value(int drm_fd, uint32_t obj_id, uint32_t obj_type,
+		const char *name, uint64_t *value)
+{
+	drmModeObjectProperties *props = drmModeObjectGetProperties(drm_fd, obj_id, obj_type);
+	if (!props)
+		return false;
+
+	bool found = false;
+	for (uint32_t i = 0; i < props->count_props && !found; ++i) {
+		drmModePropertyRes *prop = drmModeGetProperty(drm_fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (strcmp(prop->name, name) == 0) {
+			*value = props->prop_values[i];
+			found = true;
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	return found;
+}
+
+static uint64_t get_plane_type(int drm_fd, uint32_t plane_id)
+{
+	uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+	get_prop_value(drm_fd, plane_id, DRM_MODE_OBJECT_PLANE, "type", &type);
+	return type;
+}
+
+static bool plane_taken(uint32_t plane_id, struct connector *conn_list)
+{
+	for (struct connector *conn = conn_list; conn; conn = conn->next) {
+		if (conn->connected && (conn->plane_id == plane_id || conn->overlay_id == plane_id))
+			return true;
+	}
+
+	return false;
+}
+
+static bool plane_has_format(int drm_fd, uint32_t plane_id, uint32_t format);
+
+/*
+ * Find a plane of 'type' for the CRTC of 'conn' which no other connector in
+ * 'conn_list' uses. If 'format' isn't 0, the plane must also support it.
+ */
+static uint32_t find_plane(int drm_fd, struct connector *conn,
+		struct connector *conn_list, uint64_t type, uint32_t format)
+{
+	drmModePlaneRes *res = drmModeGetPlaneResources(drm_fd);
+	if (!res) {
+		perror("drmModeGetPlaneResources");
+		return 0;
+	}
+
+	uint32_t plane_id = 0;
+	for (uint32_t i = 0; i < res->count_planes && !plane_id; ++i) {
+		drmModePlane *plane = drmModeGetPlane(drm_fd, res->planes[i]);
+		if (!plane)
+			continue;
+
+		if ((plane->possible_crtcs & (1u << conn->crtc_index)) &&
+				!plane_taken(plane->plane_id, conn_list) &&
+				get_plane_type(drm_fd, plane->plane_id) == type &&
+				(!format || plane_has_format(drm_fd, plane->plane_id, format)))
+			plane_id = plane->plane_id;
+
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(res);
+	return plane_id;
+}
+
+static bool get_plane_props(int drm_fd, uint32_t plane_id, struct plane_props *p)
+{
+	struct prop_lookup plane_props[] = {
+		{ "FB_ID", &p->fb_id },
+		{ "CRTC_ID", &p->crtc_id },
+		{ "SRC_X", &p->src_x },
+		{ "SRC_Y", &p->src_y },
+		{ "SRC_W", &p->src_w },
+		{ "SRC_H", &p->src_h },
+		{ "CRTC_X", &p->crtc_x },
+		{ "CRTC_Y", &p->crtc_y },
+		{ "CRTC_W", &p->crtc_w },
+		{ "CRTC_H", &p->crtc_h },
+	};
+	return get_props(drm_fd, plane_id, DRM_MODE_OBJECT_PLANE, plane_props,
+			sizeof plane_props / sizeof plane_props[0]);
+}
+
+// possible_crtcs is a 32-bit mask
+#define MAX_CRTCS 32
+
+struct matching {
+	uint32_t *reachable;   // per connector, mask of CRTCs it can use
+	uint32_t *current;     // per connector, bit of the CRTC it's on now
+	int owner[MAX_CRTCS];  // connector holding each CRTC, or -1
+	uint32_t visited;
+	int num_crtcs;
+};
+
+/*
+ * Try to find a CRTC for connector 'i', moving other connectors onto
+ * different CRTCs if that frees one up (an augmenting path).
+ */
+static bool augment(struct matching *m, int i)
+{
+	// The CRTC it's already on is tried first, then the rest in order
+	for (int pass = 0; pass < 2; ++pass) {
+		for (int c = 0; c < m->num_crtcs; ++c) {
+			uint32_t bit = 1u << c;
+			if (!(m->reachable[i] & bit) || (m->visited & bit))
+				continue;
+
+			if ((pass == 0) != (bit == m->current[i]))
+				continue;
+
+			m->visited |= bit;
+			if (m->owner[c] < 0 || augment(m, m->owner[c])) {
+				m->owner[c] = i;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Give as many of the 'count' connectors as possible a CRTC of their own.
+ * This is a maximum bipartite matching between connectors and the CRTCs
+ * their encoders can drive, so a connector only loses out entirely if
+ * there really is no way to light it alongside the others. Connectors keep
+ * the CRTC they are already on whenever possible.
+ */
+void kms_assign_crtcs(int drm_fd, drmModeRes *res, struct crtc_match *matches, int count)
+{
+	// Fetch every encoder once, rather than once per connector using it
+	drmModeEncoder **encoders = calloc(res->count_encoders ? res->count_encoders : 1,
+			sizeof *encoders);
+	uint32_t *reachable = calloc(count ? count : 1, sizeof *reachable);
+	uint32_t *current = calloc(count ? count : 1, sizeof *current);
+	if (!encoders || !reachable || !current) {
+		perror("calloc");
+		goto out;
+	}
+
+	for (int i = 0; i < res->count_encoders; ++i)
+		encoders[i] = drmModeGetEncoder(drm_fd, res->encoders[i]);
+
+	struct matching m = {
+		.reachable = reachable,
+		.current = current,
+		.num_crtcs = res->count_crtcs < MAX_CRTCS ? res->count_crtcs : MAX_CRTCS,
+	};
+	for (int c = 0; c < MAX_CRTCS; ++c)
+		m.owner[c] = -1;
+
+	for (int i = 0; i < count; ++i) {
+		drmModeConnector *conn = matches[i].drm_conn;
+		matches[i].current_crtc_id = 0;
+		matches[i].crtc_id = 0;
+
+		for (int e = 0; e < res->count_encoders; ++e) {
+			drmModeEncoder *enc = encoders[e];
+			if (!enc)
+				continue;
+
+			for (int j = 0; j < conn->count_encoders; ++j) {
+				if (conn->encoders[j] == enc->encoder_id)
+					reachable[i] |= enc->possible_crtcs;
+			}
+
+			if (enc->encoder_id == conn->encoder_id)
+				matches[i].current_crtc_id = enc->crtc_id;
+		}
+
+		for (int c = 0; c < m.num_crtcs; ++c) {
+			if (res->crtcs[c] == matches[i].current_crtc_id)
+				current[i] = 1u << c;
+		}
+	}
+
+	for (int i = 0; i < count; ++i) {
+		m.visited = 0;
+		augment(&m, i);
+	}
+
+	for (int c = 0; c < m.num_crtcs; ++c) {
+		if (m.owner[c] >= 0) {
+			matches[m.owner[c]].crtc_id = res->crtcs[c];
+			matches[m.owner[c]].crtc_index = c;
+		}
+	}
+
+out:
+	for (int i = 0; encoders && i < res->count_encoders; ++i) {
+		if (encoders[i])
+			drmModeFreeEncoder(encoders[i]);
+	}
+	free(encoders);
+	free(reachable);
+	free(current);
+}
+
+/*
+ * Find a CRTC for one more connector, without moving any of the connected
+ * ones in 'conn_list' off theirs. The one it's on already is preferred.
+ */
+bool kms_find_free_crtc(int drm_fd, struct crtc_match *match, struct connector *conn_list)
+{
+	drmModeRes *res = drmModeGetResources(drm_fd);
+	if (!res) {
+		perror("drmModeGetResources");
+		return false;
+	}
+
+	drmModeConnector *conn = match->drm_conn;
+	int num_crtcs = res->count_crtcs < MAX_CRTCS ? res->count_crtcs : MAX_CRTCS;
+	uint32_t reachable = 0;
+	match->current_crtc_id = 0;
+	match->crtc_id = 0;
+
+	for (int j = 0; j < conn->count_encoders; ++j) {
+		drmModeEncoder *enc = drmModeGetEncoder(drm_fd, conn->encoders[j]);
+		if (!enc)
+			continue;
+
+		reachable |= enc->possible_crtcs;
+		if (enc->encoder_id == conn->encoder_id)
+			match->current_crtc_id = enc->crtc_id;
+		drmModeFreeEncoder(enc);
+	}
+
+	for (struct connector *other = conn_list; other; other = other->next) {
+		if (other->connected && other->crtc_id)
+			reachable &= ~(1u << other->crtc_index);
+	}
+
+	for (int pass = 0; pass < 2 && !match->crtc_id; ++pass) {
+		for (int c = 0; c < num_crtcs; ++c) {
+			if (!(reachable & (1u << c)))
+				continue;
+
+			if (pass == 0 && res->crtcs[c] != match->current_crtc_id)
+				continue;
+
+			match->crtc_id = res->crtcs[c];
+			match->crtc_index = c;
+			break;
+		}
+	}
+
+	drmModeFreeResources(res);
+	return match->crtc_id != 0;
+}
+
+/*
+ * Switch 'drm_fd' over to atomic modesetting, if the driver supports it.
+ * Legacy ioctls keep working either way.
+ */
+bool kms_enable_atomic(int drm_fd)
+{
+	if (drmSetClientCap(drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) < 0)
+		return false;
+
+	return drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+}
+
+/*
+ * Look up the atomic properties of 'conn' and of its CRTC, and pick a
+ * primary plane for that CRTC which no other connector in 'conn_list' uses.
+ */
+bool kms_prepare_connector(int drm_fd, struct connector *conn,
+		struct connector *conn_list)
+{
+	struct kms_props *p = &conn->props;
+
+	struct prop_lookup conn_props[] = {
+		{ "CRTC_ID", &p->conn_crtc_id },
+	};
+	if (!get_props(drm_fd, conn->id, DRM_MODE_OBJECT_CONNECTOR, conn_props, 1))
+		return false;
+
+	struct prop_lookup crtc_props[] = {
+		{ "MODE_ID", &p->crtc_mode_id },
+		{ "ACTIVE", &p->crtc_active },
+	};
+	if (!get_props(drm_fd, conn->crtc_id, DRM_MODE_OBJECT_CRTC, crtc_props, 2))
+		return false;
+
+	conn->plane_id = find_plane(drm_fd, conn, conn_list, DRM_PLANE_TYPE_PRIMARY, 0);
+	if (!conn->plane_id) {
+		fprintf(stderr, "No primary plane for CRTC %"PRIu32"\n", conn->crtc_id);
+		return false;
+	}
+
+	return get_plane_props(drm_fd, conn->plane_id, &p->primary);
+}
+
+/*
+ * Pick an overlay plane for the CRTC of 'conn' that can show its format
+ * and which no other connector in 'conn_list' uses, for compact mode.
+ */
+bool kms_prepare_overlay(int drm_fd, struct connector *conn,
+		struct connector *conn_list)
+{
+	conn->overlay_id = find_plane(drm_fd, conn, conn_list, DRM_PLANE_TYPE_OVERLAY,
+			conn->format);
+	if (!conn->overlay_id)
+		return false;
+
+	if (!get_plane_props(drm_fd, conn->overlay_id, &conn->props.overlay)) {
+		conn->overlay_id = 0;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Look 'format' up in an IN_FORMATS blob. Dumb buffers are always linear,
+ * so the format only counts if it comes with the linear modifier.
+ */
+static bool blob_has_format(const drmModePropertyBlobRes *blob, uint32_t format)
+{
+	const struct drm_format_modifier_blob *header = blob->data;
+	if (blob->length < sizeof *header ||
+			header->formats_offset + (uint64_t)header->count_formats * sizeof(uint32_t) > blob->length ||
+			header->modifiers_offset + (uint64_t)header->count_modifiers *
+				sizeof(struct drm_format_modifier) > blob->length)
+		return false;
+
+	const uint32_t *formats = (const uint32_t *)((const uint8_t *)blob->data +
+			header->formats_offset);
+	const struct drm_format_modifier *mods = (const struct drm_format_modifier *)
+		((const uint8_t *)blob->data + header->modifiers_offset);
+
+	for (uint32_t i = 0; i < header->count_formats; ++i) {
+		if (formats[i] != format)
+			continue;
+
+		// Each modifier covers 64 formats, starting at 'offset'
+		for (uint32_t j = 0; j < header->count_modifiers; ++j) {
+			if (mods[j].modifier == DRM_FORMAT_MOD_LINEAR &&
+					i >= mods[j].offset && i < mods[j].offset + 64 &&
+					(mods[j].formats >> (i - mods[j].offset)) & 1)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static bool plane_has_format(int drm_fd, uint32_t plane_id, uint32_t format)
+{
+	uint64_t blob_id;
+	if (get_prop_value(drm_fd, plane_id, DRM_MODE_OBJECT_PLANE, "IN_FORMATS", &blob_id)) {
+		drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(drm_fd, blob_id);
+		if (blob) {
+			bool found = blob_has_format(blob, format);
+			drmModeFreePropertyBlob(blob);
+			return found;
+		}
+	}
+
+	// Older kernels only list formats, all of which work with linear buffers
+	drmModePlane *plane = drmModeGetPlane(drm_fd, plane_id);
+	if (!plane)
+		return false;
+
+	bool found = false;
+	for (uint32_t i = 0; i < plane->count_formats; ++i)
+		found |= plane->formats[i] == format;
+
+	drmModeFreePlane(plane);
+	return found;
+}
+
+/*
+ * Pick the framebuffer format for 'conn': 'format' if its primary plane can
+ * scan it out (and, for C8, its CRTC has a 256-entry palette), otherwise
+ * XRGB8888. Without a known plane, as on the legacy path, 'format' is
+ * trusted as is, and it's up to AddFB2 to refuse it.
+ */
+uint32_t kms_choose_format(int drm_fd, const struct connector *conn, uint32_t format)
+{
+	if (format == DRM_FORMAT_XRGB8888)
+		return format;
+
+	if (conn->plane_id && !plane_has_format(drm_fd, conn->plane_id, format)) {
+		fprintf(stderr, "%s: Plane %"PRIu32" can't scan out %s, using XRGB8888\n",
+				conn->name, conn->plane_id, format_name(format));
+		return DRM_FORMAT_XRGB8888;
+	}
+
+	if (format == DRM_FORMAT_C8) {
+		drmModeCrtc *crtc = drmModeGetCrtc(drm_fd, conn->crtc_id);
+		bool palette = crtc && crtc->gamma_size == 256;
+		if (crtc)
+			drmModeFreeCrtc(crtc);
+
+		if (!palette) {
+			fprintf(stderr, "%s: CRTC %"PRIu32" has no 256-entry palette, using XRGB8888\n",
+					conn->name, conn->crtc_id);
+			return DRM_FORMAT_XRGB8888;
+		}
+	}
+
+	return format;
+}
+
+/*
+ * Save the gamma ramp of the CRTC of 'conn', then replace it with the C8
+ * palette from format_palette().
+ */
+bool kms_load_palette(int drm_fd, struct connector *conn)
+{
+	// kms_choose_format() made sure the CRTC has exactly 256 entries
+	uint16_t *saved = malloc(3 * 256 * sizeof *saved);
+	if (!saved) {
+		perror("malloc");
+		return false;
+	}
+
+	if (drmModeCrtcGetGamma(drm_fd, conn->crtc_id, 256,
+				saved, saved + 256, saved + 512) < 0) {
+		perror("drmModeCrtcGetGamma");
+		free(saved);
+		saved = NULL;
+	}
+	conn->saved_gamma = saved;
+
+	uint16_t palette[3 * 256];
+	format_palette(palette, palette + 256, palette + 512);
+	if (drmModeCrtcSetGamma(drm_fd, conn->crtc_id, 256,
+				palette, palette + 256, palette + 512) < 0) {
+		perror("drmModeCrtcSetGamma");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Put back the gamma ramp kms_load_palette() replaced, if any.
+ */
+void kms_restore_gamma(int drm_fd, struct connector *conn)
+{
+	uint16_t *saved = conn->saved_gamma;
+	if (!saved)
+		return;
+
+	drmModeCrtcSetGamma(drm_fd, conn->crtc_id, 256, saved, saved + 256, saved + 512);
+	free(saved);
+	conn->saved_gamma = NULL;
+}
+
+/*
+ * Show the 'src' rectangle of framebuffer 'fb_id' on a plane, stretched to
+ * the 'dst' rectangle of the CRTC. A 0 'fb_id' turns the plane off.
+ */
+static bool add_plane_rect(drmModeAtomicReq *req, uint32_t plane_id,
+		const struct plane_props *p, uint32_t crtc_id, uint32_t fb_id,
+		const struct placement *rect)
+{
+	bool ok = true;
+
+	// Source coordinates are 16.16 fixed point
+	ok &= drmModeAtomicAddProperty(req, plane_id, p->fb_id, fb_id) >= 0;
+	ok &= drmModeAtomicAddProperty(req, plane_id, p->crtc_id, fb_id ? crtc_id : 0) >= 0;
+	ok &= drmModeAtomicAddProperty(req, plane_id, p->src_x, (uint64_t)rect->src_x << 16) >= 0;
+	ok &= drmModeAtomicAddProperty(req, plane_id, p->src_y, (uint64_t)rect->src_y << 16) >= 0;
+	ok &= drmModeAtomicAddProperty(req, plane_id, p->src_w, (uint64_t)rect->src_width << 16) >= 0;
+	ok &= drmModeAtomicAddProperty(req, plane_id, p->src_h, (uint64_t)rect->src_height << 16) >= 0;
+	ok &= drmModeAtomicAddProperty(req, plane_id, p->crtc_x, rect->dst_x) >= 0;
+	ok &= drmModeAtomicAddProperty(req, plane_id, p->crtc_y, rect->dst_y) >= 0;
+	ok &= drmModeAtomicAddProperty(req, plane_id, p->crtc_w, rect->width) >= 0;
+	ok &= drmModeAtomicAddProperty(req, plane_id, p->crtc_h, rect->height) >= 0;
+
+	return ok;
+}
+
+static bool add_plane(drmModeAtomicReq *req, uint32_t plane_id, const struct plane_props *p,
+		uint32_t crtc_id, const struct dumb_framebuffer *fb,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	struct placement rect = {
+		.src_width = fb->width,
+		.src_height = fb->height,
+		.dst_x = x,
+		.dst_y = y,
+		.width = width,
+		.height = height,
+	};
+	return add_plane_rect(req, plane_id, p, crtc_id, fb->id, &rect);
+}
+
+static bool add_connector(drmModeAtomicReq *req, struct connector *conn)
+{
+	const struct kms_props *p = &conn->props;
+	const struct dumb_framebuffer *fb = &conn->fb[conn->front];
+	bool ok = true;
+
+	// If the CRTC is already lit in our mode, only the plane changes, which
+	// keeps the kernel from doing a full modeset and retraining the link
+	if (!conn->reuse_mode) {
+		ok &= drmModeAtomicAddProperty(req, conn->id, p->conn_crtc_id, conn->crtc_id) >= 0;
+
+		ok &= drmModeAtomicAddProperty(req, conn->crtc_id, p->crtc_mode_id, conn->mode_blob) >= 0;
+		ok &= drmModeAtomicAddProperty(req, conn->crtc_id, p->crtc_active, 1) >= 0;
+	}
+
+	if (!conn->compact)
+		return ok && add_plane(req, conn->plane_id, &p->primary, conn->crtc_id, fb,
+				0, 0, conn->width, conn->height);
+
+	// The background is stretched across the whole display, and the
+	// splash shown unscaled on top of it
+	ok &= add_plane(req, conn->plane_id, &p->primary, conn->crtc_id, &conn->background,
+			0, 0, conn->width, conn->height);
+	ok &= add_plane(req, conn->overlay_id, &p->overlay, conn->crtc_id, fb,
+			conn->plane_x, conn->plane_y, fb->width, fb->height);
+
+	return ok;
+}
+
+/*
+ * Make sure 'conn' has a mode blob and add its whole configuration to 'req'.
+ */
+static bool build_connector(int drm_fd, drmModeAtomicReq *req, struct connector *conn)
+{
+	if (!conn->mode_blob && drmModeCreatePropertyBlob(drm_fd, &conn->mode,
+				sizeof conn->mode, &conn->mode_blob) < 0) {
+		perror("drmModeCreatePropertyBlob");
+		return false;
+	}
+
+	return add_connector(req, conn);
+}
+
+/*
+ * Ask the driver whether it would accept lighting 'conn' on its own with
+ * its current framebuffers, without touching the display.
+ */
+bool kms_test_connector(int drm_fd, struct connector *conn)
+{
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (!req) {
+		perror("drmModeAtomicAlloc");
+		return false;
+	}
+
+	bool ok = build_connector(drm_fd, req, conn) &&
+		drmModeAtomicCommit(drm_fd, req, DRM_MODE_ATOMIC_TEST_ONLY |
+				DRM_MODE_ATOMIC_ALLOW_MODESET, NULL) == 0;
+
+	drmModeAtomicFree(req);
+	return ok;
+}
+
+/*
+ * Work out where a 'width' x 'height' frame goes on 'conn': fit to the
+ * display keeping its aspect ratio if 'scale', otherwise centred and
+ * cropped to the display.
+ */
+static void place_frame(const struct connector *conn, uint32_t width, uint32_t height,
+		bool scale, struct placement *p)
+{
+	*p = (struct placement) { .src_width = width, .src_height = height };
+
+	if (scale) {
+		if ((uint64_t)width * conn->height > (uint64_t)height * conn->width) {
+			p->width = conn->width;
+			p->height = (uint64_t)height * conn->width / width;
+		} else {
+			p->width = (uint64_t)width * conn->height / height;
+			p->height = conn->height;
+		}
+	} else {
+		p->width = width < conn->width ? width : conn->width;
+		p->height = height < conn->height ? height : conn->height;
+		p->src_x = (width - p->width) / 2;
+		p->src_y = (height - p->height) / 2;
+		p->src_width = p->width;
+		p->src_height = p->height;
+	}
+
+	p->dst_x = (conn->width - p->width) / 2;
+	p->dst_y = (conn->height - p->height) / 2;
+}
+
+/*
+ * Check 'req' with TEST_ONLY, and only if that passes, commit it for real.
+ * Without ALLOW_MODESET in 'flags' this is just a flip on the next vblank.
+ */
+static bool commit(int drm_fd, drmModeAtomicReq *req, uint32_t flags)
+{
+	if (drmModeAtomicCommit(drm_fd, req, DRM_MODE_ATOMIC_TEST_ONLY | flags, NULL) < 0)
+		return false;
+
+	if (drmModeAtomicCommit(drm_fd, req, flags, NULL) < 0) {
+		perror("drmModeAtomicCommit");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Put the 'width' x 'height' framebuffer 'fb_id' on the primary plane of
+ * every connected connector in 'conn_list' in one atomic commit, in place
+ * of the splash. With 'scale' the plane stretches it to fit each display,
+ * which not every driver can do.
+ * The commit blocks until the new frame is on screen, so the buffer shown
+ * before it is free again once this returns.
+ */
+bool kms_show_fb(int drm_fd, struct connector *conn_list, uint32_t fb_id,
+		uint32_t width, uint32_t height, bool scale)
+{
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (!req) {
+		perror("drmModeAtomicAlloc");
+		return false;
+	}
+
+	bool ok = true;
+	for (struct connector *conn = conn_list; conn && ok; conn = conn->next) {
+		if (!conn->connected)
+			continue;
+
+		struct placement rect;
+		place_frame(conn, width, height, scale, &rect);
+		ok = add_plane_rect(req, conn->plane_id, &conn->props.primary, conn->crtc_id,
+				fb_id, &rect);
+
+		// The frame replaces the whole compact layout
+		if (conn->compact) {
+			struct placement off = { 0 };
+			ok &= add_plane_rect(req, conn->overlay_id, &conn->props.overlay,
+					conn->crtc_id, 0, &off);
+		}
+	}
+
+	ok = ok && commit(drm_fd, req, 0);
+	drmModeAtomicFree(req);
+	return ok;
+}
+
+/*
+ * Switch every connected connector in 'conn_list' back from a frame shown
+ * with kms_show_fb() to its own front buffer, without a modeset.
+ */
+bool kms_show_splash(int drm_fd, struct connector *conn_list)
+{
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (!req) {
+		perror("drmModeAtomicAlloc");
+		return false;
+	}
+
+	bool ok = true;
+	for (struct connector *conn = conn_list; conn && ok; conn = conn->next) {
+		if (conn->connected)
+			ok = add_connector(req, conn);
+	}
+
+	ok = ok && commit(drm_fd, req, 0);
+	drmModeAtomicFree(req);
+	return ok;
+}
+
+/*
+ * Light 'conn' alone, e.g. after it was plugged in, in a commit that
+ * leaves every other CRTC as it is.
+ */
+bool kms_light_connector(int drm_fd, struct connector *conn)
+{
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (!req) {
+		perror("drmModeAtomicAlloc");
+		return false;
+	}
+
+	bool ok = build_connector(drm_fd, req, conn) &&
+		commit(drm_fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET);
+
+	drmModeAtomicFree(req);
+	return ok;
+}
+
+/*
+ * Turn off the CRTC and planes of 'conn', e.g. after it was unplugged,
+ * in a commit that leaves every other CRTC as it is.
+ */
+bool kms_disable_connector(int drm_fd, struct connector *conn)
+{
+	const struct kms_props *p = &conn->props;
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (!req) {
+		perror("drmModeAtomicAlloc");
+		return false;
+	}
+
+	struct placement off = { 0 };
+	bool ok = true;
+	ok &= drmModeAtomicAddProperty(req, conn->id, p->conn_crtc_id, 0) >= 0;
+	ok &= drmModeAtomicAddProperty(req, conn->crtc_id, p->crtc_mode_id, 0) >= 0;
+	ok &= drmModeAtomicAddProperty(req, conn->crtc_id, p->crtc_active, 0) >= 0;
+	ok &= add_plane_rect(req, conn->plane_id, &p->primary, conn->crtc_id, 0, &off);
+	if (conn->compact)
+		ok &= add_plane_rect(req, conn->overlay_id, &p->overlay, conn->crtc_id, 0, &off);
+
+	ok = ok && commit(drm_fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET);
+	drmModeAtomicFree(req);
+	return ok;
+}
+
+/*
+ * Let the CRTC of 'conn' go as slowly as the display allows between flips.
+ * There are none while idle, so it drops to the bottom of its VRR range.
+ */
+static bool enable_vrr(int drm_fd, struct connector *conn)
+{
+	uint64_t capable = 0;
+	if (!get_prop_value(drm_fd, conn->id, DRM_MODE_OBJECT_CONNECTOR, "vrr_capable",
+				&capable) || !capable)
+		return false;
+
+	uint32_t vrr_enabled;
+	struct prop_lookup crtc_props[] = {
+		{ "VRR_ENABLED", &vrr_enabled },
+	};
+	if (!get_props(drm_fd, conn->crtc_id, DRM_MODE_OBJECT_CRTC, crtc_props, 1))
+		return false;
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (!req) {
+		perror("drmModeAtomicAlloc");
+		return false;
+	}
+
+	bool ok = drmModeAtomicAddProperty(req, conn->crtc_id, vrr_enabled, 1) >= 0 &&
+		commit(drm_fd, req, 0);
+
+	drmModeAtomicFree(req);
+	return ok;
+}
+
+/*
+ * Cut down the scanout of 'conn' while nothing on it changes. If the
+ * display can do variable refresh, it's left to refresh as slowly as it
+ * likes, otherwise 'mode', if not NULL, replaces the current one, which
+ * it must match in size. That's only done if the driver can switch
+ * seamlessly, unless 'allow_modeset', as a full modeset blanks the display,
+ * on HDMI sometimes for seconds. Returns whether anything changed.
+ */
+bool kms_set_idle(int drm_fd, struct connector *conn, const drmModeModeInfo *mode,
+		bool allow_modeset)
+{
+	if (enable_vrr(drm_fd, conn))
+		return true;
+	if (!mode)
+		return false;
+
+	uint32_t blob;
+	if (drmModeCreatePropertyBlob(drm_fd, mode, sizeof *mode, &blob) < 0) {
+		perror("drmModeCreatePropertyBlob");
+		return false;
+	}
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (!req) {
+		perror("drmModeAtomicAlloc");
+		drmModeDestroyPropertyBlob(drm_fd, blob);
+		return false;
+	}
+
+	// The planes keep their framebuffers and size, only the timings change.
+	// Without ALLOW_MODESET the driver only takes that if it can do it on
+	// the fly, e.g. by stretching the vertical blank.
+	bool ok = drmModeAtomicAddProperty(req, conn->crtc_id, conn->props.crtc_mode_id, blob) >= 0;
+	bool seamless = ok && commit(drm_fd, req, 0);
+	if (ok && !seamless && allow_modeset) {
+		fprintf(stderr, "%s: Switching to the idle mode needs a modeset\n", conn->name);
+		ok = commit(drm_fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET);
+	} else {
+		ok = seamless;
+	}
+	drmModeAtomicFree(req);
+
+	if (!ok) {
+		drmModeDestroyPropertyBlob(drm_fd, blob);
+		return false;
+	}
+
+	// Later commits for this connector carry the new mode along
+	if (conn->mode_blob)
+		drmModeDestroyPropertyBlob(drm_fd, conn->mode_blob);
+	conn->mode_blob = blob;
+	conn->mode = *mode;
+	conn->rate = refresh_rate(mode);
+	return true;
+}
+
+/*
+ * Light every connected connector in 'conn_list' with its first framebuffer
+ * in a single atomic commit, after checking it with TEST_ONLY. Connectors
+ * marked 'reuse_mode' only get their scanout buffer swapped, and if that's
+ * all of them, no modeset is allowed at all.
+ * On failure nothing has changed on screen.
+ */
+bool kms_atomic_modeset(int drm_fd, struct connector *conn_list)
+{
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (!req) {
+		perror("drmModeAtomicAlloc");
+		return false;
+	}
+
+	bool ok = true;
+	uint32_t flags = 0;
+	for (struct connector *conn = conn_list; conn && ok; conn = conn->next) {
+		if (!conn->connected)
+			continue;
+
+		if (conn->reuse_mode) {
+			ok = add_connector(req, conn);
+			continue;
+		}
+
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+		ok = build_connector(drm_fd, req, conn);
+	}
+
+	if (ok) {
+		int ret = drmModeAtomicCommit(drm_fd, req, DRM_MODE_ATOMIC_TEST_ONLY | flags, NULL);
+		if (ret < 0) {
+			perror("atomic test commit");
+			ok = false;
+		}
+	}
+
+	if (ok) {
+		int ret = drmModeAtomicCommit(drm_fd, req, flags, NULL);
+		if (ret < 0) {
+			perror("drmModeAtomicCommit");
+			ok = false;
+		}
+	}
+
+	drmModeAtomicFree(req);
+	return ok;
+}
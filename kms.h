@@ -0,0 +1,129 @@
+#ifndef KMS_H
+#define KMS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "connector.h"
+
+/*
+ * One connector's request for a CRTC, see kms_assign_crtcs().
+ */
+struct crtc_match {
+	drmModeConnector *drm_conn;
+
+	uint32_t current_crtc_id; // CRTC driving the connector right now, if any
+	uint32_t crtc_id;         // the CRTC it was given, or 0
+	uint32_t crtc_index;      // ...and its position in drmModeRes::crtcs
+};
+
+/*
+ * Give as many of the 'count' connectors as possible a CRTC of their own.
+ * This is a maximum bipartite matching between connectors and the CRTCs
+ * their encoders can drive, so a connector only loses out entirely if
+ * there really is no way to light it alongside the others. Connectors keep
+ * the CRTC they are already on whenever possible.
+ */
+void kms_assign_crtcs(int drm_fd, drmModeRes *res, struct crtc_match *matches, int count);
+
+/*
+ * Find a CRTC for one more connector, without moving any of the connected
+ * ones in 'conn_list' off theirs. The one it's on already is preferred.
+ */
+bool kms_find_free_crtc(int drm_fd, struct crtc_match *match, struct connector *conn_list);
+
+/*
+ * Switch 'drm_fd' over to atomic modesetting, if the driver supports it.
+ * Legacy ioctls keep working either way.
+ */
+bool kms_enable_atomic(int drm_fd);
+
+/*
+ * Look up the atomic properties of 'conn' and of its CRTC, and pick a
+ * primary plane for that CRTC which no other connector in 'conn_list' uses.
+ */
+bool kms_prepare_connector(int drm_fd, struct connector *conn,
+		struct connector *conn_list);
+
+/*
+ * Pick an overlay plane for the CRTC of 'conn' that can show its format
+ * and which no other connector in 'conn_list' uses, for compact mode.
+ */
+bool kms_prepare_overlay(int drm_fd, struct connector *conn,
+		struct connector *conn_list);
+
+/*
+ * Ask the driver whether it would accept lighting 'conn' on its own with
+ * its current framebuffers, without touching the display.
+ */
+bool kms_test_connector(int drm_fd, struct connector *conn);
+
+/*
+ * Pick the framebuffer format for 'conn': 'format' if its primary plane can
+ * scan it out (and, for C8, its CRTC has a 256-entry palette), otherwise
+ * XRGB8888. Without a known plane, as on the legacy path, 'format' is
+ * trusted as is, and it's up to AddFB2 to refuse it.
+ */
+uint32_t kms_choose_format(int drm_fd, const struct connector *conn, uint32_t format);
+
+/*
+ * Save the gamma ramp of the CRTC of 'conn', then replace it with the C8
+ * palette from format_palette().
+ */
+bool kms_load_palette(int drm_fd, struct connector *conn);
+
+/*
+ * Put back the gamma ramp kms_load_palette() replaced, if any.
+ */
+void kms_restore_gamma(int drm_fd, struct connector *conn);
+
+/*
+ * Put the 'width' x 'height' framebuffer 'fb_id' on the primary plane of
+ * every connected connector in 'conn_list' in one atomic commit, in place
+ * of the splash. With 'scale' the plane stretches it to fit each display,
+ * which not every driver can do.
+ * The commit blocks until the new frame is on screen, so the buffer shown
+ * before it is free again once this returns.
+ */
+bool kms_show_fb(int drm_fd, struct connector *conn_list, uint32_t fb_id,
+		uint32_t width, uint32_t height, bool scale);
+
+/*
+ * Switch every connected connector in 'conn_list' back from a frame shown
+ * with kms_show_fb() to its own front buffer, without a modeset.
+ */
+bool kms_show_splash(int drm_fd, struct connector *conn_list);
+
+/*
+ * Light 'conn' alone, e.g. after it was plugged in, in a commit that
+ * leaves every other CRTC as it is.
+ */
+bool kms_light_connector(int drm_fd, struct connector *conn);
+
+/*
+ * Turn off the CRTC and planes of 'conn', e.g. after it was unplugged,
+ * in a commit that leaves every other CRTC as it is.
+ */
+bool kms_disable_connector(int drm_fd, struct connector *conn);
+
+/*
+ * Cut down the scanout of 'conn' while nothing on it changes. If the
+ * display can do variable refresh, it's left to refresh as slowly as it
+ * likes, otherwise 'mode', if not NULL, replaces the current one, which
+ * it must match in size. That's only done if the driver can switch
+ * seamlessly, unless 'allow_modeset', as a full modeset blanks the display,
+ * on HDMI sometimes for seconds. Returns whether anything changed.
+ */
+bool kms_set_idle(int drm_fd, struct connector *conn, const drmModeModeInfo *mode,
+		bool allow_modeset);
+
+/*
+ * Light every connected connector in 'conn_list' with its first framebuffer
+ * in a single atomic commit, after checking it with TEST_ONLY. Connectors
+ * marked 'reuse_mode' only get their scanout buffer swapped, and if that's
+ * all of them, no modeset is allowed at all.
+ * On failure nothing has changed on screen.
+ */
+bool kms_atomic_modeset(int drm_fd, struct connector *conn_list);
+
+#endif
@@ -1,182 +1,1259 @@
 #include <drm_fourcc.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <signal.h>
 
+#include "blit.h"
+#include "cache.h"
+#include "connector.h"
+#include "control.h"
+#include "device.h"
+#include "event.h"
+#include "fb.h"
+#include "hotplug.h"
+#include "image.h"
+#include "kms.h"
+#include "mode.h"
+#include "pool.h"
+#include "progress.h"
+#include "stats.h"
+#include "stream.h"
+#include "text.h"
+#include "timing.h"
 #include "util.h"
 
-struct dumb_framebuffer {
-	uint32_t id;     // DRM object ID
-	uint32_t width;
-	uint32_t height;
-	uint32_t stride;
-	uint32_t handle; // driver-specific handle
-	uint64_t size;   // size of mapping
+static struct event_loop loop;
+
+// Every framebuffer we draw into comes from here
+static struct fb_pool pool;
+
+/*
+ * Everything needed to set up a display and draw to it, whether at startup,
+ * when it's plugged in later, or when told to over the control socket.
+ */
+struct splash_state {
+	int drm_fd;
+	struct connector *conn_list;
+	bool atomic;
+
+	// From the command line
+	struct mode_policy mode_policy;
+	uint32_t format;
+	bool compact;
+	bool animate;
+	enum scale_filter filter;
+	enum fill_mode fill_mode;
+	uint32_t foreground, background;
+
+	struct image image;          // kept around for late displays if 'hotplug'
+	const char *cache_dir;       // of prerendered frames, or NULL
+	uint64_t image_hash;         // of 'image' as read at startup, for the cache
+	bool hotplug;
+	int progress;                // last set over the control socket, or -1
+	struct imported_fb imported; // shown instead of the splash, if its id isn't 0
+
+	char message[TEXT_MAX_LENGTH + 1]; // last set over the control socket
+	struct font_atlas *atlases;        // glyphs in every format and size in use
+
+	// Seconds without a command before the displays go slow, or 0
+	uint32_t idle_timeout;
+	bool idle_modeset; // ...even if that blanks them
+	struct event_source idle; // timerfd, -1 until the event loop runs
+};
 
-	uint8_t *data;   // mmapped data we can write to
+struct probe_job {
+	int drm_fd;
+	uint32_t connector_id;
+	drmModeConnector *drm_conn;
 };
 
-struct connector {
-	uint32_t id;
+static void probe_connector(struct probe_job *job)
+{
+	// This may probe the connector and read its EDID, which is slow
+	uint64_t start = timing_now();
+	job->drm_conn = drmModeGetConnector(job->drm_fd, job->connector_id);
+	if (!job->drm_conn) {
+		perror("drmModeGetConnector");
+		return;
+	}
+
 	char name[16];
-	bool connected;
+	snprintf(name, sizeof name, "%s-%"PRIu32,
+			conn_str(job->drm_conn->connector_type),
+			job->drm_conn->connector_type_id);
+	timing_record("get_connector", name, start);
+}
+
+// Side of the solid background buffer in compact mode, stretched by the
+// primary plane to cover the display
+#define BACKGROUND_SIZE 64
+
+struct prepare_job {
+	int drm_fd;
+	struct connector *conn;
+	enum fill_mode fill_mode;
+	uint32_t background;
+
+	// Where to look for the frame prerendered on an earlier boot, if set
+	const char *cache_dir;
+	uint64_t image_hash;
+	enum scale_filter filter;
+};
+
+/*
+ * Where the cached frame of 'conn' in its mode and format lives.
+ */
+static void cache_path(char *path, size_t size, const char *dir,
+		const struct connector *conn)
+{
+	snprintf(path, size, "%s/%s-%"PRIu32"x%"PRIu32"@%"PRIu32"-%s.fb", dir, conn->name,
+			conn->width, conn->height, conn->rate, format_name(conn->format));
+}
+
+static void cache_key_init(struct cache_key *key, const struct connector *conn,
+		uint64_t image_hash, enum fill_mode fill_mode, uint32_t background,
+		enum scale_filter filter)
+{
+	memset(key, 0, sizeof *key);
+	key->image_hash = image_hash;
+	key->width = conn->fb[0].width;
+	key->height = conn->fb[0].height;
+	key->format = conn->format;
+	key->fill_mode = fill_mode;
+	key->background = background;
+	key->filter = filter;
+	key->splash = conn->splash;
+}
+
+/*
+ * Fill the framebuffers of 'conn' from the cache, if the frame in there
+ * was rendered from the same image, layout and mode.
+ */
+static bool load_cached(const struct prepare_job *job, struct connector *conn)
+{
+	char path[4096];
+	cache_path(path, sizeof path, job->cache_dir, conn);
+
+	struct cache_key key;
+	cache_key_init(&key, conn, job->image_hash, job->fill_mode, job->background,
+			job->filter);
+
+	uint64_t start = timing_now();
+	for (int i = 0; i < conn->num_fbs; ++i) {
+		if (!cache_load(path, &key, &conn->fb[i]))
+			return false;
+	}
+	timing_record("cache_load", conn->name, start);
+
+	return true;
+}
+
+/*
+ * Give the framebuffers of 'conn' back to the pool.
+ */
+static void release_fbs(struct connector *conn)
+{
+	fb_end_shadow(&conn->fb[0]);
+	for (int i = 0; i < conn->num_fbs; ++i)
+		fb_pool_put(&pool, &conn->fb[i]);
+	if (conn->compact)
+		fb_pool_put(&pool, &conn->background);
+
+	// A zero ID is how the twin search tells it has none
+	memset(conn->fb, 0, sizeof conn->fb);
+	memset(&conn->background, 0, sizeof conn->background);
+}
+
+static bool create_fbs(int drm_fd, struct connector *conn, const struct fill_policy *fill)
+{
+	const struct placement *p = &conn->splash;
+	uint32_t width = conn->compact ? p->width : conn->width;
+	uint32_t height = conn->compact ? p->height : conn->height;
+
+	for (int i = 0; i < conn->num_fbs; ++i) {
+		if (!fb_pool_get(&pool, drm_fd, width, height, conn->format, fill, &conn->fb[i])) {
+			while (i--)
+				fb_pool_put(&pool, &conn->fb[i]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Set up the compact layout of 'conn': a splash-sized framebuffer that the
+ * image covers completely, over a tiny solid background. Fails, leaving
+ * nothing allocated, if the driver won't take that plane configuration.
+ */
+static bool prepare_compact(int drm_fd, struct connector *conn, uint32_t background)
+{
+	struct fill_policy solid = { .mode = FILL_SOLID, .color = background };
+	struct fill_policy none = { .mode = FILL_NONE };
+
+	if (!fb_pool_get(&pool, drm_fd, BACKGROUND_SIZE, BACKGROUND_SIZE, conn->format,
+				&solid, &conn->background))
+		return false;
+
+	if (!create_fbs(drm_fd, conn, &none)) {
+		fb_pool_put(&pool, &conn->background);
+		return false;
+	}
+
+	// Scaling the primary plane, or it not covering the CRTC by itself, is
+	// where drivers tend to draw the line
+	if (!kms_test_connector(drm_fd, conn)) {
+		release_fbs(conn);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Go back to a full-screen framebuffer with the splash placed on it. The
+ * framebuffers still have to be made.
+ */
+static void leave_compact(struct connector *conn)
+{
+	conn->compact = false;
+	conn->overlay_id = 0;
+	conn->splash.dst_x = conn->plane_x;
+	conn->splash.dst_y = conn->plane_y;
+	conn->plane_x = conn->plane_y = 0;
+}
+
+static void *prepare_connector(void *data)
+{
+	struct prepare_job *job = data;
+	struct connector *conn = job->conn;
+
+	uint64_t start = timing_now();
+	if (conn->compact) {
+		if (prepare_compact(job->drm_fd, conn, job->background)) {
+			timing_record("create_fb", conn->name, start);
+			conn->cached = job->cache_dir && load_cached(job, conn);
+			if (job->cache_dir && !conn->cached)
+				fb_start_shadow(&conn->fb[0]);
+			return NULL;
+		}
+
+		fprintf(stderr, "%s: Driver rejected the compact layout\n", conn->name);
+		leave_compact(conn);
+	}
+
+	struct fill_policy fill = {
+		.mode = job->fill_mode,
+		.color = job->background,
+		.x = conn->splash.dst_x,
+		.y = conn->splash.dst_y,
+		.width = conn->splash.width,
+		.height = conn->splash.height,
+	};
+	// A cached frame covers everything, so only fill on a miss
+	struct fill_policy none = { .mode = FILL_NONE };
+	bool created = create_fbs(job->drm_fd, conn, job->cache_dir ? &none : &fill);
+
+	// Without a plane to ask on the legacy path, AddFB2 is the first to
+	// tell whether the driver can do the format at all
+	if (!created && conn->format != DRM_FORMAT_XRGB8888) {
+		fprintf(stderr, "%s: Driver rejected %s framebuffers, using XRGB8888\n",
+				conn->name, format_name(conn->format));
+		conn->format = DRM_FORMAT_XRGB8888;
+		created = create_fbs(job->drm_fd, conn, job->cache_dir ? &none : &fill);
+	}
+	if (!created) {
+		conn->connected = false;
+		return NULL;
+	}
+	timing_record("create_fb", conn->name, start);
+
+	conn->cached = job->cache_dir && load_cached(job, conn);
+	if (job->cache_dir && !conn->cached) {
+		// What's drawn from here on is also kept in memory to be saved
+		// later; the other framebuffers get the very same pixels
+		fb_start_shadow(&conn->fb[0]);
+		for (int i = 0; i < conn->num_fbs; ++i)
+			fill_fb(&conn->fb[i], &fill);
+	}
+
+	return NULL;
+}
+
+/*
+ * Work out where 'img' goes on a 'width' x 'height' display.
+ * Decoded images are centred, and either scaled to fit or cropped if they
+ * are too big. Raw images are assumed to match the display, but may be short.
+ */
+static void place_splash(uint32_t width, uint32_t height, const struct image *img,
+		enum scale_filter filter, struct placement *p)
+{
+	if (img->format == IMAGE_FORMAT_RAW) {
+		size_t rows = img->size / ((size_t)width * 4);
+		*p = (struct placement) {
+			.src_width = width,
+			.src_height = rows < height ? rows : height,
+			.width = width,
+			.height = rows < height ? rows : height,
+		};
+		return;
+	}
+
+	if (filter != SCALE_NONE) {
+		// Letterbox: the largest size with the image's aspect ratio that fits
+		uint32_t w = width, h = height;
+		if ((uint64_t)width * img->height > (uint64_t)height * img->width)
+			w = (uint64_t)img->width * height / img->height;
+		else
+			h = (uint64_t)img->height * width / img->width;
+
+		*p = (struct placement) {
+			.src_width = img->width,
+			.src_height = img->height,
+			.dst_x = (width - w) / 2,
+			.dst_y = (height - h) / 2,
+			.width = w,
+			.height = h,
+		};
+		return;
+	}
+
+	if (img->width <= width) {
+		p->src_x = 0;
+		p->dst_x = (width - img->width) / 2;
+		p->width = img->width;
+	} else {
+		p->src_x = (img->width - width) / 2;
+		p->dst_x = 0;
+		p->width = width;
+	}
 
-	drmModeCrtc *saved;
+	if (img->height <= height) {
+		p->src_y = 0;
+		p->dst_y = (height - img->height) / 2;
+		p->height = img->height;
+	} else {
+		p->src_y = (img->height - height) / 2;
+		p->dst_y = 0;
+		p->height = height;
+	}
 
-	uint32_t crtc_id;
-	drmModeModeInfo mode;
+	p->src_width = p->width;
+	p->src_height = p->height;
+}
 
-	uint32_t width;
-	uint32_t height;
-	uint32_t rate;
+static void load_raw_image(struct dumb_framebuffer *fb, const struct placement *p,
+		const struct image *img)
+{
+	// The image is packed XRGB8888 at the framebuffer's resolution, but the
+	// driver is free to pad each framebuffer row out to a larger pitch.
+	size_t row_size = (size_t)fb->width * 4;
+	size_t expected = row_size * fb->height;
+
+	if (fb->stride == row_size && fb->format == DRM_FORMAT_XRGB8888) {
+		// No padding, so the whole image is one contiguous copy
+		stream_copy(fb->data, img->data, p->height * row_size);
+	} else {
+		for (uint32_t y = 0; y < p->height; ++y) {
+			fb_write_row(fb, 0, y, (const uint32_t *)(img->data + y * row_size),
+					fb->width);
+		}
+	}
 
-	struct dumb_framebuffer fb;
+	if (img->size != expected) {
+		fprintf(stderr, "Warning: Input image size (%zu bytes) doesn't match %"PRIu32"x%"PRIu32" (%zu bytes)\n",
+				img->size, fb->width, fb->height, expected);
+	}
+}
 
-	struct connector *next;
+/*
+ * The displays to load the splash image into: every connected one in
+ * 'conn_list', or only 'only' if that's set.
+ */
+struct splash_target {
+	struct connector *conn_list;
+	struct connector *only;
 };
 
-// Global variable to track if we should exit
-static volatile sig_atomic_t keep_running = 1;
+/*
+ * Whether 'conn' is the first connected display in 'conn_list' to scan out
+ * of its framebuffer, which it may share with others after it.
+ */
+static bool first_user(const struct connector *conn_list, const struct connector *conn)
+{
+	for (const struct connector *other = conn_list; other != conn; other = other->next) {
+		if (other->connected && other->fb[0].id == conn->fb[0].id)
+			return false;
+	}
+
+	return true;
+}
 
-// Signal handler for clean shutdown
-void signal_handler(int sig)
+static bool is_target(const struct splash_target *target, const struct connector *conn)
 {
-	keep_running = 0;
+	if (!conn->connected || conn->cached)
+		return false;
+	if (target->only)
+		return conn == target->only;
+
+	// Shared framebuffers only need the image once
+	return first_user(target->conn_list, conn);
 }
 
-static uint32_t find_crtc(int drm_fd, drmModeRes *res, drmModeConnector *conn,
-		uint32_t *taken_crtcs)
+/*
+ * Decoder callback: copy one image row into every framebuffer it shows up on.
+ */
+static void splash_row(void *user_data, uint32_t y, const uint32_t *row)
 {
-	for (int i = 0; i < conn->count_encoders; ++i) {
-		drmModeEncoder *enc = drmModeGetEncoder(drm_fd, conn->encoders[i]);
-		if (!enc)
+	const struct splash_target *target = user_data;
+
+	for (struct connector *conn = target->conn_list; conn; conn = conn->next) {
+		if (!is_target(target, conn))
 			continue;
 
-		for (int i = 0; i < res->count_crtcs; ++i) {
-			uint32_t bit = 1 << i;
-			// Not compatible
-			if ((enc->possible_crtcs & bit) == 0)
-				continue;
+		const struct placement *p = &conn->splash;
+		if (y < p->src_y || y >= p->src_y + p->height)
+			continue;
 
-			// Already taken
-			if (*taken_crtcs & bit)
-				continue;
+		for (int i = 0; i < conn->num_fbs; ++i) {
+			fb_write_row(&conn->fb[i], p->dst_x, p->dst_y + y - p->src_y,
+					row + p->src_x, p->width);
+		}
+	}
+}
+
+/*
+ * Write one scaled row of the splash into every framebuffer of a display.
+ */
+static void scaled_row(void *user_data, uint32_t y, const uint32_t *row)
+{
+	struct connector *conn = user_data;
+	const struct placement *p = &conn->splash;
+
+	for (int i = 0; i < conn->num_fbs; ++i)
+		fb_write_row(&conn->fb[i], p->dst_x, p->dst_y + y, row, p->width);
+}
+
+/*
+ * Decode the image once and scale it into every framebuffer.
+ */
+static bool load_scaled_image(const struct splash_target *target, const struct image *img,
+		enum scale_filter filter)
+{
+	// It may have been decoded while the displays were being probed
+	uint32_t *pixels = img->pixels ? img->pixels : image_decode_pixels(img);
+	if (!pixels)
+		return false;
+
+	bool ok = true;
+	for (struct connector *conn = target->conn_list; conn && ok; conn = conn->next) {
+		if (!is_target(target, conn))
+			continue;
+
+		// Scaled once per display, a row at a time, and written out to
+		// all of its framebuffers through fb_write_row()
+		const struct placement *p = &conn->splash;
+		ok = scale_image_rows(p->width, p->height,
+				(const uint8_t *)pixels, img->width * 4, img->width, img->height,
+				filter, scaled_row, conn);
+	}
+
+	if (pixels != img->pixels)
+		free(pixels);
+	return ok;
+}
+
+/*
+ * Copy the splash image into the framebuffer of every connected display,
+ * or if 'only' is set, just that one's.
+ * Compressed images are decoded exactly once, and unless they need scaling,
+ * straight into all of them.
+ */
+static bool load_splash_image(struct connector *conn_list, struct connector *only,
+		const struct image *img, enum scale_filter filter)
+{
+	struct splash_target target = { .conn_list = conn_list, .only = only };
+
+	if (img->format != IMAGE_FORMAT_RAW) {
+		if (filter != SCALE_NONE)
+			return load_scaled_image(&target, img, filter);
+		return image_decode(img, splash_row, &target);
+	}
+
+	// Without an image the displays show just the fill, e.g. with --early
+	for (struct connector *conn = conn_list; conn && img->size; conn = conn->next) {
+		if (!is_target(&target, conn))
+			continue;
+
+		for (int i = 0; i < conn->num_fbs; ++i)
+			load_raw_image(&conn->fb[i], &conn->splash, img);
+	}
+
+	return true;
+}
+
+/*
+ * Whether 'a' and 'b' end up with framebuffers that look exactly the same:
+ * the same size and format, with the image in the same place. Animated
+ * ones never do, as each display flips through its buffers in its own time.
+ */
+static bool same_content(const struct connector *a, const struct connector *b)
+{
+	uint32_t a_width = a->compact ? a->splash.width : a->width;
+	uint32_t a_height = a->compact ? a->splash.height : a->height;
+	uint32_t b_width = b->compact ? b->splash.width : b->width;
+	uint32_t b_height = b->compact ? b->splash.height : b->height;
+
+	return a->num_fbs == 1 && b->num_fbs == 1 &&
+		a->compact == b->compact && a->format == b->format &&
+		a_width == b_width && a_height == b_height &&
+		memcmp(&a->splash, &b->splash, sizeof a->splash) == 0;
+}
+
+/*
+ * Find a display other than 'conn' that's up already and whose framebuffer
+ * 'conn' can scan out of as well.
+ */
+static struct connector *find_twin(struct connector *conn_list, const struct connector *conn)
+{
+	for (struct connector *other = conn_list; other; other = other->next) {
+		if (other != conn && other->connected && other->fb[0].id &&
+				same_content(other, conn))
+			return other;
+	}
+
+	return NULL;
+}
 
-			drmModeFreeEncoder(enc);
-			*taken_crtcs |= bit;
-			return res->crtcs[i];
+/*
+ * Set up 'conn' with the framebuffers of 'twin' instead of its own. Fails,
+ * taking nothing, if its CRTC won't take the compact layout they need.
+ */
+static bool share_fbs(int drm_fd, struct connector *conn, const struct connector *twin)
+{
+	conn->fb[0] = twin->fb[0];
+	conn->fb[0].shadow = NULL; // the twin saves what's drawn into it
+	fb_pool_ref(&pool, &conn->fb[0]);
+	if (!conn->compact)
+		return true;
+
+	conn->background = twin->background;
+	fb_pool_ref(&pool, &conn->background);
+	if (!kms_test_connector(drm_fd, conn)) {
+		release_fbs(conn);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Make a connector for the DRM one, filling in its ID and name.
+ */
+static struct connector *new_connector(const drmModeConnector *drm_conn)
+{
+	struct connector *conn = calloc(1, sizeof *conn);
+	if (!conn) {
+		perror("malloc");
+		return NULL;
+	}
+
+	conn->id = drm_conn->connector_id;
+	snprintf(conn->name, sizeof conn->name, "%s-%"PRIu32,
+			conn_str(drm_conn->connector_type),
+			drm_conn->connector_type_id);
+	return conn;
+}
+
+/*
+ * Find the glyphs for the status message of 'conn' in its format, and work
+ * out where the message goes.
+ */
+static void setup_text(struct splash_state *state, struct connector *conn)
+{
+	// The message goes under the bar, with glyphs rendered once for all
+	// displays of this format and size
+	uint32_t scale = conn->height / 240 ? conn->height / 240 : 1;
+	conn->font = font_atlas_get(&state->atlases, conn->format, scale,
+			state->foreground, state->background);
+	for (int i = 0; i < 2; ++i) {
+		text_line_init(&conn->text[i], conn->font, conn->width, conn->height,
+				conn->bar.y + conn->bar.height * 2);
+	}
+}
+
+/*
+ * Work out how 'conn', which already has its CRTC, is going to be lit:
+ * its primary plane, mode, format, and where the splash and progress bar
+ * go. Fails if it needs atomic modesetting but can't get its properties
+ * or a plane.
+ */
+static bool setup_connector(struct splash_state *state, struct connector *conn,
+		drmModeConnector *drm_conn)
+{
+	printf("%s: Using CRTC %"PRIu32"\n", conn->name, conn->crtc_id);
+	fflush(stdout);
+
+	// Planes are handed out one connector at a time, so no two
+	// connectors can end up with the same one
+	uint64_t start = timing_now();
+	bool prepared = !state->atomic ||
+		kms_prepare_connector(state->drm_fd, conn, state->conn_list);
+	timing_record("prepare_atomic", conn->name, start);
+
+	conn->mode = *mode_select(drm_conn, &state->mode_policy);
+
+	conn->width = conn->mode.hdisplay;
+	conn->height = conn->mode.vdisplay;
+	conn->rate = refresh_rate(&conn->mode);
+
+	printf("  Using mode %"PRIu32"x%"PRIu32"@%"PRIu32"\n",
+			conn->width, conn->height, conn->rate);
+	fflush(stdout);
+
+	conn->format = kms_choose_format(state->drm_fd, conn, state->format);
+	if (conn->format != DRM_FORMAT_XRGB8888) {
+		printf("  Using format %s\n", format_name(conn->format));
+		fflush(stdout);
+	}
+
+	place_splash(conn->width, conn->height, &state->image, state->filter, &conn->splash);
+
+	conn->num_fbs = state->animate ? 2 : 1;
+	conn->front = 0;
+	conn->pending = -1;
+	conn->animating = state->animate && state->progress < 0;
+	conn->progress = state->progress;
+	conn->idle = false;
+	flip_stats_init(&conn->stats, conn->rate);
+	progress_bar_init(&conn->bar, conn->width, conn->height,
+			state->foreground, state->background);
+
+	setup_text(state, conn);
+	return prepared;
+}
+
+/*
+ * Switch 'conn' to the compact layout if it was asked for and can work.
+ */
+static void choose_compact(struct splash_state *state, struct connector *conn)
+{
+	// Compact mode needs atomic to move both planes at once, a free
+	// overlay plane, and a still image that doesn't fill the screen
+	if (state->compact && state->atomic && !conn->animating &&
+			state->image.format != IMAGE_FORMAT_RAW &&
+			conn->splash.width && conn->splash.height &&
+			kms_prepare_overlay(state->drm_fd, conn, state->conn_list)) {
+		conn->compact = true;
+		conn->plane_x = conn->splash.dst_x;
+		conn->plane_y = conn->splash.dst_y;
+		conn->splash.dst_x = conn->splash.dst_y = 0;
+	}
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Start counting down to idle again, from now.
+ */
+static void arm_idle(struct splash_state *state)
+{
+	if (state->idle.fd < 0)
+		return;
+
+	struct itimerspec timeout = { .it_value.tv_sec = state->idle_timeout };
+	if (timerfd_settime(state->idle.fd, 0, &timeout, NULL) < 0)
+		perror("timerfd_settime");
+}
+
+/*
+ * Nothing has been asked of us for a while, so let the displays that show
+ * a still image scan it out as slowly as they can. They stay that way, as
+ * the odd progress update looks no different at a lower refresh rate.
+ */
+static void handle_idle(struct event_source *source, uint32_t events)
+{
+	struct splash_state *state = source->data;
+
+	uint64_t expirations;
+	if (read(source->fd, &expirations, sizeof expirations) != sizeof expirations)
+		return;
+
+	for (struct connector *conn = state->conn_list; conn; conn = conn->next) {
+		// An animation isn't idle, and not a flip can be in flight
+		if (!conn->connected || conn->idle || conn->animating || conn->pending >= 0)
+			continue;
+
+		drmModeConnector *drm_conn = drmModeGetConnectorCurrent(state->drm_fd, conn->id);
+		if (!drm_conn) {
+			perror("drmModeGetConnectorCurrent");
+			continue;
 		}
 
-		drmModeFreeEncoder(enc);
+		uint32_t rate = conn->rate;
+		const drmModeModeInfo *mode = mode_select_idle(drm_conn, &conn->mode);
+		conn->idle = kms_set_idle(state->drm_fd, conn, mode, state->idle_modeset);
+		drmModeFreeConnector(drm_conn);
+
+		if (conn->idle && conn->rate != rate) {
+			conn->stats.period_us = 1000000000ull / conn->rate;
+			printf("%s: Idle, using mode %"PRIu32"x%"PRIu32"@%"PRIu32"\n",
+					conn->name, conn->width, conn->height, conn->rate);
+			fflush(stdout);
+		} else if (conn->idle) {
+			printf("%s: Idle, using variable refresh\n", conn->name);
+			fflush(stdout);
+		}
 	}
+}
 
-	return 0;
+/*
+ * Draw the next animation frame into the back buffer and queue a flip to it.
+ * The frame is only shown at the next vblank, and the flip event tells us
+ * when the other buffer is free to draw into again.
+ */
+static void queue_frame(int drm_fd, struct connector *conn, uint64_t time_ms)
+{
+	int back = !conn->front;
+	flip_stats_render(&conn->stats, timing_now() / 1000);
+
+	// The flip itself makes the driver pick up the whole new buffer
+	progress_bar_draw_busy(&conn->bar, &conn->fb[back], time_ms, NULL);
+
+	int ret = drmModePageFlip(drm_fd, conn->crtc_id, conn->fb[back].id,
+			DRM_MODE_PAGE_FLIP_EVENT, conn);
+	if (ret < 0) {
+		perror("drmModePageFlip");
+		conn->animating = false;
+		return;
+	}
+
+	conn->pending = back;
+}
+
+/*
+ * Bring the determinate progress bar of 'conn' up to date on screen.
+ * It's drawn straight into the front buffer, so if a flip is still in
+ * flight this waits for page_flip_handler() to call it again.
+ */
+static void show_progress(int drm_fd, struct connector *conn)
+{
+	if (conn->progress < 0 || conn->pending >= 0)
+		return;
+
+	struct dumb_framebuffer *fb = &conn->fb[conn->front];
+	drmModeClip clip;
+	if (progress_bar_draw(&conn->bar, fb, conn->progress, &clip))
+		fb_flush(drm_fd, fb, &clip, 1);
+}
+
+/*
+ * Show the status message of 'state' on 'conn', in every framebuffer so
+ * it stays put while they're flipped between.
+ */
+static void show_message(struct splash_state *state, struct connector *conn)
+{
+	// In compact mode the text would be off the framebuffer too
+	if (!conn->connected || conn->compact || !conn->font)
+		return;
+
+	for (int i = 0; i < conn->num_fbs; ++i) {
+		drmModeClip clip;
+		if (text_draw(conn->font, &conn->text[i], &conn->fb[i], state->message, &clip) &&
+				i == conn->front)
+			fb_flush(state->drm_fd, &conn->fb[i], &clip, 1);
+	}
+}
+
+static bool set_message(void *data, const char *text)
+{
+	struct splash_state *state = data;
+
+	arm_idle(state);
+	snprintf(state->message, sizeof state->message, "%s", text);
+	for (struct connector *conn = state->conn_list; conn; conn = conn->next)
+		show_message(state, conn);
+
+	return true;
+}
+
+/*
+ * Report the page flip timing of every display, one line each.
+ */
+static bool get_stats(void *data, char *reply, size_t size)
+{
+	struct splash_state *state = data;
+
+	size_t len = 0;
+	for (struct connector *conn = state->conn_list; conn; conn = conn->next) {
+		if (!conn->connected)
+			continue;
+
+		int ret = flip_stats_format(&conn->stats, conn->name, reply + len, size - len);
+		if (ret < 0 || (size_t)ret >= size - len)
+			return false;
+		len += ret;
+	}
+
+	return true;
+}
+
+static bool set_progress(void *data, uint32_t percent)
+{
+	struct splash_state *state = data;
+
+	arm_idle(state);
+
+	for (struct connector *conn = state->conn_list; conn; conn = conn->next) {
+		// In compact mode the bar would be off the framebuffer
+		if (!conn->connected || conn->compact)
+			continue;
+
+		// A determinate bar takes over from the busy animation
+		conn->animating = false;
+		conn->progress = percent;
+		show_progress(state->drm_fd, conn);
+	}
+
+	// ...as it does on displays plugged in later
+	state->progress = percent;
+	return true;
+}
+
+/*
+ * Replace the splash image on every display with 'img', in the framebuffers
+ * that are already up, so no modeset is needed. Takes over 'img'.
+ */
+static bool replace_image(struct splash_state *state, struct image *img)
+{
+	for (struct connector *conn = state->conn_list; conn; conn = conn->next) {
+		if (!conn->connected)
+			continue;
+
+		// Compact framebuffers keep their size, and the image is fit to them
+		place_splash(conn->fb[0].width, conn->fb[0].height, img, state->filter,
+				&conn->splash);
+		conn->cached = false;
+		if (!first_user(state->conn_list, conn))
+			continue;
+
+		// The margins of the old image have to go, even without a fill,
+		// so that's done in black as the kernel handed the buffers to us
+		struct fill_policy fill = {
+			.mode = state->fill_mode == FILL_NONE ? FILL_MARGINS : state->fill_mode,
+			.color = state->fill_mode == FILL_NONE ? 0 : state->background,
+			.x = conn->splash.dst_x,
+			.y = conn->splash.dst_y,
+			.width = conn->splash.width,
+			.height = conn->splash.height,
+		};
+		for (int i = 0; i < conn->num_fbs; ++i)
+			fill_fb(&conn->fb[i], &fill);
+	}
+
+	bool ok = load_splash_image(state->conn_list, NULL, img, state->filter);
+
+	// Displays plugged in from now on get the new image too
+	if (state->hotplug) {
+		image_finish(&state->image);
+		state->image = *img;
+	} else {
+		image_finish(img);
+	}
+
+	// Bring the splash back if an imported frame is covering it
+	if (state->imported.id && kms_show_splash(state->drm_fd, state->conn_list))
+		destroy_imported_fb(state->drm_fd, &state->imported, NULL);
+
+	for (struct connector *conn = state->conn_list; conn; conn = conn->next) {
+		if (!conn->connected)
+			continue;
+
+		// Everything changed, including whatever the bar and the
+		// message were drawn over
+		fb_flush(state->drm_fd, &conn->fb[conn->front], NULL, 0);
+		conn->bar.filled = -1;
+		show_progress(state->drm_fd, conn);
+		for (int i = 0; i < 2; ++i)
+			memset(conn->text[i].shown, 0, sizeof conn->text[i].shown);
+		if (state->message[0])
+			show_message(state, conn);
+	}
+
+	return ok;
+}
+
+/*
+ * Replace the splash image on every display with the one behind 'fd'.
+ */
+static bool set_image(void *data, int fd)
+{
+	arm_idle(data);
+
+	// Reading a pipe or socket would stall the event loop until the client
+	// got round to writing all of it, so only take what can be mapped
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Images sent over the socket must be files or memfds\n");
+		return false;
+	}
+
+	struct image img = { 0 };
+	if (!image_map_fd(fd, &img))
+		return false;
+	if (!image_probe(&img)) {
+		image_finish(&img);
+		return false;
+	}
+
+	return replace_image(data, &img);
 }
 
-bool create_fb(int drm_fd, uint32_t width, uint32_t height, struct dumb_framebuffer *fb)
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, void *user_data)
 {
-	int ret;
+	struct connector *conn = user_data;
+
+	conn->front = conn->pending;
+	conn->pending = -1;
+	flip_stats_flip(&conn->stats, sequence, tv_sec * 1000000ull + tv_usec);
+
+	// Pace the animation by the time the frame actually hit the screen
+	if (conn->animating)
+		queue_frame(fd, conn, tv_sec * 1000ull + tv_usec / 1000);
+	else
+		show_progress(fd, conn);
+}
 
-	struct drm_mode_create_dumb create = {
-		.width = width,
-		.height = height,
-		.bpp = 32,
+static void handle_drm(struct event_source *source, uint32_t events)
+{
+	drmEventContext evctx = {
+		.version = 2,
+		.page_flip_handler = page_flip_handler,
 	};
 
-	ret = drmIoctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create);
-	if (ret < 0) {
-		perror("DRM_IOCTL_MODE_CREATE_DUMB");
+	drmHandleEvent(source->fd, &evctx);
+}
+
+/*
+ * Stop every animation and wait for the flips still in flight to land, so
+ * each display's front buffer is the one on screen.
+ */
+static void stop_animations(int drm_fd, struct connector *conn_list)
+{
+	struct event_source source = { .fd = drm_fd };
+
+	for (struct connector *conn = conn_list; conn; conn = conn->next) {
+		conn->animating = false;
+
+		while (conn->connected && conn->pending >= 0) {
+			// If a flip takes longer than this, it's not coming
+			struct pollfd pfd = { .fd = drm_fd, .events = POLLIN };
+			if (poll(&pfd, 1, 1000) <= 0)
+				break;
+			handle_drm(&source, 0);
+		}
+	}
+}
+
+/*
+ * Scan out a dma-buf made by someone else, e.g. a video decoder, on every
+ * display in place of the splash. Nothing is copied.
+ */
+static bool set_dmabuf(void *data, int fd, const struct dmabuf_frame *frame)
+{
+	struct splash_state *state = data;
+
+	if (!state->atomic) {
+		fprintf(stderr, "Showing dma-bufs needs atomic modesetting\n");
 		return false;
 	}
+	arm_idle(state);
 
-	fb->height = height;
-	fb->width = width;
-	fb->stride = create.pitch;
-	fb->handle = create.handle;
-	fb->size = create.size;
+	// The frames replace the animation, and the commit can't go in while a
+	// flip is still pending
+	stop_animations(state->drm_fd, state->conn_list);
 
-	uint32_t handles[4] = { fb->handle };
-	uint32_t strides[4] = { fb->stride };
-	uint32_t offsets[4] = { 0 };
+	// A producer showing a still picture sends the same dma-buf again,
+	// which comes back with the handle the frame on screen is using
+	struct imported_fb fb;
+	if (!import_fb(state->drm_fd, fd, frame, &state->imported, &fb))
+		return false;
 
-	ret = drmModeAddFB2(drm_fd, width, height, DRM_FORMAT_XRGB8888,
-			handles, strides, offsets, &fb->id, 0);
-	if (ret < 0) {
-		perror("drmModeAddFB2");
-		goto error_dumb;
+	// Let the planes scale the frame if they can, otherwise centre it
+	if (!kms_show_fb(state->drm_fd, state->conn_list, fb.id, fb.width, fb.height, true) &&
+			!kms_show_fb(state->drm_fd, state->conn_list, fb.id, fb.width, fb.height, false)) {
+		destroy_imported_fb(state->drm_fd, &fb, &state->imported);
+		return false;
 	}
 
-	struct drm_mode_map_dumb map = { .handle = fb->handle };
-	ret = drmIoctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map);
-	if (ret < 0) {
-		perror("DRM_IOCTL_MODE_MAP_DUMB");
-		goto error_fb;
+	// The commit waited for the new frame to be shown, so the old one is free
+	if (state->imported.id)
+		destroy_imported_fb(state->drm_fd, &state->imported, &fb);
+	state->imported = fb;
+	return true;
+}
+
+/*
+ * Light 'conn' after it was plugged in, on a CRTC none of the others use.
+ */
+static bool plug_connector(struct splash_state *state, struct connector *conn,
+		drmModeConnector *drm_conn)
+{
+	int drm_fd = state->drm_fd;
+
+	struct crtc_match match = { .drm_conn = drm_conn };
+	if (!kms_find_free_crtc(drm_fd, &match, state->conn_list)) {
+		fprintf(stderr, "Could not find CRTC for %s\n", conn->name);
+		return false;
 	}
+	conn->current_crtc_id = match.current_crtc_id;
+	conn->crtc_id = match.crtc_id;
+	conn->crtc_index = match.crtc_index;
+
+	// Unlike at startup, the others are lit already, so there is no
+	// falling back to legacy modesetting for this one alone
+	if (!setup_connector(state, conn, drm_conn))
+		goto err;
+	choose_compact(state, conn);
+
+	// A display showing the same already has the image in its framebuffer
+	struct connector *twin = find_twin(state->conn_list, conn);
+	conn->connected = true;
+	if (twin && share_fbs(drm_fd, conn, twin)) {
+		printf("%s: Sharing framebuffer %"PRIu32" with %s\n",
+				conn->name, conn->fb[0].id, twin->name);
+		fflush(stdout);
+	} else {
+		struct prepare_job job = {
+			.drm_fd = drm_fd,
+			.conn = conn,
+			.fill_mode = state->fill_mode,
+			.background = state->background,
+		};
+		prepare_connector(&job);
+		if (!conn->connected)
+			goto err;
+		if (conn->font && conn->font->format != conn->format)
+			setup_text(state, conn);
+
+		if (!load_splash_image(state->conn_list, conn, &state->image, state->filter))
+			fprintf(stderr, "%s: Failed to load splash image\n", conn->name);
+	}
+
+	conn->saved = drmModeGetCrtc(drm_fd, conn->crtc_id);
+	if (conn->format == DRM_FORMAT_C8)
+		kms_load_palette(drm_fd, conn);
 
-	fb->data = mmap(0, fb->size, PROT_READ | PROT_WRITE, MAP_SHARED,
-			drm_fd, map.offset);
-	if (!fb->data) {
-		perror("mmap");
-		goto error_fb;
+	bool lit;
+	if (state->atomic) {
+		lit = kms_light_connector(drm_fd, conn);
+	} else {
+		lit = !conn->compact && drmModeSetCrtc(drm_fd, conn->crtc_id, conn->fb[0].id,
+				0, 0, &conn->id, 1, &conn->mode) == 0;
+	}
+	if (!lit) {
+		fprintf(stderr, "%s: Failed to light the display\n", conn->name);
+		conn->animating = false;
 	}
 
-	memset(fb->data, 0xff, fb->size);
+	if (conn->animating)
+		queue_frame(drm_fd, conn, now_ms());
+	else
+		show_progress(drm_fd, conn);
+	if (state->message[0])
+		show_message(state, conn);
 
+	// A new display starts out at full speed, so give it the whole timeout
+	arm_idle(state);
 	return true;
 
-error_fb:
-	drmModeRmFB(drm_fd, fb->id);
-error_dumb:
-	;
-	struct drm_mode_destroy_dumb destroy = { .handle = fb->handle };
-	drmIoctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+err:
+	conn->connected = false;
+	conn->crtc_id = 0;
+	conn->plane_id = 0;
+	conn->overlay_id = 0;
+	conn->compact = false;
 	return false;
 }
 
-bool load_splash_image_from_stdin(struct dumb_framebuffer *fb)
+/*
+ * Turn off 'conn' after it was unplugged and free everything it had, so the
+ * CRTC and planes are free for the next display.
+ */
+static void unplug_connector(struct splash_state *state, struct connector *conn)
 {
-	printf("Reading splash image from stdin...\n");
-	fflush(stdout);
+	int drm_fd = state->drm_fd;
+	struct event_source source = { .fd = drm_fd };
+
+	// The flip event refers to 'conn', so it has to land first
+	conn->animating = false;
+	while (conn->pending >= 0) {
+		struct pollfd pfd = { .fd = drm_fd, .events = POLLIN };
+		if (poll(&pfd, 1, 1000) <= 0)
+			break;
+		handle_drm(&source, 0);
+	}
 
-	// Read the raw image data from stdin
-	ssize_t total_read = 0;
-	uint8_t *ptr = fb->data;
-	size_t remaining = fb->size;
+	if (state->atomic)
+		kms_disable_connector(drm_fd, conn);
+	else
+		drmModeSetCrtc(drm_fd, conn->crtc_id, 0, 0, 0, NULL, 0, NULL);
 
-	while (remaining > 0) {
-		ssize_t bytes_read = read(STDIN_FILENO, ptr, remaining);
-		if (bytes_read < 0) {
-			perror("read from stdin");
-			return false;
+	// Kept for the next display of the same size, or for a twin still on it
+	release_fbs(conn);
+
+	if (conn->mode_blob) {
+		drmModeDestroyPropertyBlob(drm_fd, conn->mode_blob);
+		conn->mode_blob = 0;
+	}
+
+	// The gamma ramp and CRTC we'd restore were for a display that's gone
+	free(conn->saved_gamma);
+	conn->saved_gamma = NULL;
+	if (conn->saved) {
+		drmModeFreeCrtc(conn->saved);
+		conn->saved = NULL;
+	}
+
+	conn->connected = false;
+	conn->crtc_id = 0;
+	conn->plane_id = 0;
+	conn->overlay_id = 0;
+	conn->compact = false;
+	conn->cached = false;
+	conn->idle = false;
+}
+
+/*
+ * Bring the connector with ID 'id' up or down to match whether something
+ * is plugged into it now.
+ */
+static void update_connector(struct splash_state *state, uint32_t id)
+{
+	struct connector **link = &state->conn_list;
+	while (*link && (*link)->id != id)
+		link = &(*link)->next;
+	struct connector *conn = *link;
+
+	drmModeConnector *drm_conn = drmModeGetConnector(state->drm_fd, id);
+	if (!drm_conn && errno == ENOENT) {
+		// The connector itself is gone, e.g. a DisplayPort MST one
+		// when the hub was unplugged
+		if (conn && conn->connected) {
+			printf("%s: Removed\n", conn->name);
+			fflush(stdout);
+			unplug_connector(state, conn);
 		}
-		if (bytes_read == 0) {
-			// EOF reached
-			break;
+		if (conn) {
+			*link = conn->next;
+			free(conn);
 		}
+		return;
+	}
+	if (!drm_conn) {
+		perror("drmModeGetConnector");
+		return;
+	}
 
-		total_read += bytes_read;
-		ptr += bytes_read;
-		remaining -= bytes_read;
+	// e.g. a new DisplayPort MST connector
+	if (!conn) {
+		conn = new_connector(drm_conn);
+		if (!conn)
+			goto out;
+		conn->next = state->conn_list;
+		state->conn_list = conn;
 	}
 
-	printf("Successfully read %zd bytes from stdin (expected %"PRIu64")\n", total_read, fb->size);
-	fflush(stdout);
+	bool plugged = drm_conn->connection == DRM_MODE_CONNECTED &&
+		drm_conn->count_modes > 0;
 
-	if (total_read != fb->size) {
-		fprintf(stderr, "Warning: Input image size (%zd bytes) doesn't match framebuffer size (%"PRIu64" bytes)\n", 
-				total_read, fb->size);
+	if (plugged && !conn->connected) {
+		printf("%s: Plugged in\n", conn->name);
+		fflush(stdout);
+		plug_connector(state, conn, drm_conn);
+	} else if (!plugged && conn->connected) {
+		printf("%s: Unplugged\n", conn->name);
+		fflush(stdout);
+		unplug_connector(state, conn);
 	}
 
-	return true;
+out:
+	drmModeFreeConnector(drm_conn);
+}
+
+static void handle_hotplug(void *data, uint32_t connector_id)
+{
+	struct splash_state *state = data;
+
+	if (connector_id) {
+		update_connector(state, connector_id);
+		return;
+	}
+
+	// The kernel didn't say which one changed, so check them all
+	drmModeRes *res = drmModeGetResources(state->drm_fd);
+	if (!res) {
+		perror("drmModeGetResources");
+		return;
+	}
+
+	// Connectors that went away altogether aren't listed any more
+	for (struct connector *old = state->conn_list, *next; old; old = next) {
+		next = old->next;
+		bool listed = false;
+		for (int i = 0; i < res->count_connectors && !listed; ++i)
+			listed = res->connectors[i] == old->id;
+		if (!listed)
+			update_connector(state, old->id);
+	}
+
+	// Unplug first, so the CRTCs are free for whatever got plugged in
+	for (int pass = 0; pass < 2; ++pass) {
+		for (int i = 0; i < res->count_connectors; ++i) {
+			struct connector *conn = state->conn_list;
+			while (conn && conn->id != res->connectors[i])
+				conn = conn->next;
+
+			if ((pass == 0) == (conn && conn->connected))
+				update_connector(state, res->connectors[i]);
+		}
+	}
+
+	drmModeFreeResources(res);
+}
+
+static void handle_signal(struct event_source *source, uint32_t events)
+{
+	struct signalfd_siginfo info;
+
+	if (read(source->fd, &info, sizeof info) != sizeof info)
+		return;
+
+	// Any of the signals we listen to means shut down, right now
+	event_loop_quit(&loop);
 }
 
 void daemonize()
@@ -207,50 +1284,459 @@ void daemonize()
 	open("/dev/null", O_WRONLY); // stderr
 }
 
-int main(void)
+/*
+ * Read the splash image from 'path', or from 'fd', e.g. stdin, if it's NULL.
+ */
+static bool read_splash(const char *path, int fd, struct image *img)
 {
-	// Set up signal handlers
-	signal(SIGTERM, signal_handler);
-	signal(SIGINT, signal_handler);
-	signal(SIGHUP, signal_handler);
+	printf("Reading splash image from %s...\n", path ? path : "stdin");
+	fflush(stdout);
 
-	/* We just take the first GPU that exists. */
-	int drm_fd = open("/dev/dri/card0", O_RDWR | O_NONBLOCK);
-	if (drm_fd < 0) {
-		perror("/dev/dri/card0");
-		return 1;
+	uint64_t start = timing_now();
+	bool loaded = path ? image_map_file(path, img) : image_read_fd(fd, img);
+	if (!loaded || !image_probe(img)) {
+		fprintf(stderr, "Failed to read splash image\n");
+		return false;
+	}
+	timing_record("read_image", path ? path : "stdin", start);
+
+	printf("Successfully read %zu bytes\n", img->size);
+	if (img->format != IMAGE_FORMAT_RAW) {
+		printf("  %s image, %"PRIu32"x%"PRIu32"\n",
+				img->format == IMAGE_FORMAT_QOI ? "QOI" : "PNG",
+				img->width, img->height);
+	}
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * Reading the splash image, on a thread of its own during bring-up, or
+ * after the daemon is up with --early.
+ */
+struct read_job {
+	const char *path; // or NULL for stdin
+	int fd;           // ...read instead, a duplicate once stdin is gone
+	struct image *img;
+	bool decode;      // ...into img->pixels, as the scaler needs them
+	bool hash;        // ...into 'hash_value', for the cache
+	uint64_t hash_value;
+	bool wait;        // for 'path' to appear, e.g. once its filesystem is mounted
+	int done_fd;      // eventfd to signal once finished, or -1
+	bool ok;
+};
+
+static void read_image(struct read_job *job)
+{
+	// Nothing tells us when a filesystem gets mounted, so keep looking
+	struct timespec retry = { .tv_nsec = 250000000 };
+	while (job->wait && job->path && access(job->path, F_OK) < 0 && errno == ENOENT)
+		nanosleep(&retry, NULL);
+
+	job->ok = read_splash(job->path, job->fd, job->img);
+	if (!job->ok)
+		return;
+
+	// Raw images are copied in as they are, so caching them gains nothing
+	job->hash = job->hash && job->img->format != IMAGE_FORMAT_RAW;
+	if (job->hash) {
+		uint64_t start = timing_now();
+		job->hash_value = cache_hash(job->img->data, job->img->size);
+		timing_record("hash_image", NULL, start);
+	}
+
+	// Unscaled images are decoded straight into the framebuffers, row by
+	// row, once they exist; the scaler needs the whole image first
+	if (job->decode && job->img->format != IMAGE_FORMAT_RAW) {
+		uint64_t start = timing_now();
+		job->img->pixels = image_decode_pixels(job->img);
+		timing_record("decode_image", NULL, start);
+	}
+}
+
+static void *read_image_job(void *data)
+{
+	struct read_job *job = data;
+
+	read_image(job);
+	if (job->done_fd >= 0 && eventfd_write(job->done_fd, 1) < 0)
+		perror("eventfd_write");
+	return NULL;
+}
+
+/*
+ * With --early, the splash image read while the event loop runs, to be
+ * drawn over whatever the displays were lit with.
+ */
+struct late_image {
+	struct event_source source; // the reader's eventfd
+	struct splash_state *state;
+	struct read_job job;
+	struct image img;
+	pthread_t reader;
+};
+
+static void handle_late_image(struct event_source *source, uint32_t events)
+{
+	struct late_image *late = (struct late_image *)source;
+
+	eventfd_t value;
+	if (eventfd_read(source->fd, &value) < 0)
+		return;
+
+	pthread_join(late->reader, NULL);
+	event_loop_remove(&loop, source);
+	close(source->fd);
+	source->fd = -1;
+	if (late->job.fd >= 0)
+		close(late->job.fd);
+
+	if (!late->job.ok) {
+		image_finish(&late->img);
+		return;
 	}
 
+	arm_idle(late->state);
+	uint64_t start = timing_now();
+	if (!replace_image(late->state, &late->img))
+		fprintf(stderr, "Failed to load splash image\n");
+	timing_record("load_image", NULL, start);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+			"\n"
+			"Options:\n"
+			"  -i, --image PATH        Map the splash image from PATH instead of reading stdin\n"
+			"  -f, --fill MODE         Paint 'none', 'solid' or only the 'margins' the image\n"
+			"                          doesn't cover (default: margins)\n"
+			"  -b, --background COLOR  Fill colour as RRGGBB hex (default: ffffff)\n"
+			"  -s, --scale FILTER      Scale PNG/QOI images to fit each display using\n"
+			"                          'nearest' or 'bilinear' filtering (default: none)\n"
+			"  -a, --animate           Show an animated progress bar, page flipped on vblank\n"
+			"  -F, --foreground COLOR  Progress bar colour as RRGGBB hex (default: 000000)\n"
+			"  -l, --legacy            Don't use atomic modesetting, even if supported\n"
+			"  -m, --mode MODE         Use the 'first' listed mode, the 'preferred' one,\n"
+			"                          the 'lowest' pixel clock at native resolution,\n"
+			"                          or WxH[@Hz] (default: first)\n"
+			"  -p, --format FORMAT     Framebuffer format: 'xrgb8888', 'rgb565' or 'c8',\n"
+			"                          if the display supports it (default: xrgb8888)\n"
+			"  -c, --compact           Only allocate a framebuffer the size of the image,\n"
+			"                          shown on an overlay plane over the background\n"
+			"  -S, --socket PATH       Take progress updates and new images on a control\n"
+			"                          socket at PATH\n"
+			"  -k, --keep              Leave the splash on screen when exiting, for the\n"
+			"                          compositor to take over without a blank frame\n"
+			"  -H, --hotplug           Light displays plugged in after startup, and turn\n"
+			"                          off the ones unplugged\n"
+			"  -C, --cache DIR         Keep each display's finished frame in DIR, and\n"
+			"                          reuse it while the image and mode stay the same\n"
+			"  -e, --early             Light the displays before reading the image, with\n"
+			"                          the built-in one or just the fill, and swap it in\n"
+			"                          once it's read\n"
+			"  -d, --device PATH       Use the DRM device at PATH, rather than the one\n"
+			"                          with the most connected displays\n"
+			"  -t, --timings PATH      Write how long each bring-up stage took to PATH,\n"
+			"                          or stderr if PATH is '-', as JSON lines\n"
+			"  -I, --idle SECONDS      After SECONDS without a command or animation, drop\n"
+			"                          each display to its lowest refresh rate, or let it\n"
+			"                          refresh as slowly as it can with VRR\n"
+			"  -M, --idle-modeset      Change the mode for --idle even if the driver can\n"
+			"                          only do it with a modeset, which blanks the display\n"
+			"  -h, --help              Show this help\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t main_start = timing_now();
+	uint64_t start;
+	const char *timings_path = NULL;
+	const char *image_path = NULL;
+	enum fill_mode fill_mode = FILL_MARGINS;
+	uint32_t background = 0xffffff;
+	enum scale_filter scale_filter = SCALE_NONE;
+	bool animate = false;
+	uint32_t foreground = 0x000000;
+	bool atomic = true;
+	struct mode_policy mode_policy = { .type = MODE_FIRST };
+	uint32_t format = DRM_FORMAT_XRGB8888;
+	bool compact = false;
+	bool keep = false;
+	bool hotplug = false;
+	const char *cache_dir = NULL;
+	bool early = false;
+	char device_path[256] = "";
+	const char *socket_path = NULL;
+	uint32_t idle_timeout = 0;
+	bool idle_modeset = false;
+
+	static const struct option long_options[] = {
+		{ "image",      required_argument, NULL, 'i' },
+		{ "fill",       required_argument, NULL, 'f' },
+		{ "background", required_argument, NULL, 'b' },
+		{ "scale",      required_argument, NULL, 's' },
+		{ "animate",    no_argument,       NULL, 'a' },
+		{ "foreground", required_argument, NULL, 'F' },
+		{ "legacy",     no_argument,       NULL, 'l' },
+		{ "mode",       required_argument, NULL, 'm' },
+		{ "format",     required_argument, NULL, 'p' },
+		{ "compact",    no_argument,       NULL, 'c' },
+		{ "socket",     required_argument, NULL, 'S' },
+		{ "keep",       no_argument,       NULL, 'k' },
+		{ "hotplug",    no_argument,       NULL, 'H' },
+		{ "cache",      required_argument, NULL, 'C' },
+		{ "early",      no_argument,       NULL, 'e' },
+		{ "device",     required_argument, NULL, 'd' },
+		{ "timings",    required_argument, NULL, 't' },
+		{ "idle",       required_argument, NULL, 'I' },
+		{ "idle-modeset", no_argument,     NULL, 'M' },
+		{ "help",       no_argument,       NULL, 'h' },
+		{ 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "i:f:b:s:aF:lm:p:cS:kHC:ed:t:I:Mh", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			image_path = optarg;
+			break;
+		case 'f':
+			if (strcmp(optarg, "none") == 0) {
+				fill_mode = FILL_NONE;
+			} else if (strcmp(optarg, "solid") == 0) {
+				fill_mode = FILL_SOLID;
+			} else if (strcmp(optarg, "margins") == 0) {
+				fill_mode = FILL_MARGINS;
+			} else {
+				fprintf(stderr, "Unknown fill mode '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+		case 'F': {
+			char *end;
+			unsigned long color = strtoul(optarg, &end, 16);
+			if (*optarg == '\0' || *end != '\0' || color > 0xffffff) {
+				fprintf(stderr, "Invalid colour '%s'\n", optarg);
+				return 1;
+			}
+			if (opt == 'b')
+				background = color;
+			else
+				foreground = color;
+			break;
+		}
+		case 'a':
+			animate = true;
+			break;
+		case 'l':
+			atomic = false;
+			break;
+		case 'm':
+			if (!mode_policy_parse(optarg, &mode_policy)) {
+				fprintf(stderr, "Invalid mode '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			if (strcmp(optarg, "xrgb8888") == 0) {
+				format = DRM_FORMAT_XRGB8888;
+			} else if (strcmp(optarg, "rgb565") == 0) {
+				format = DRM_FORMAT_RGB565;
+			} else if (strcmp(optarg, "c8") == 0) {
+				format = DRM_FORMAT_C8;
+			} else {
+				fprintf(stderr, "Unknown pixel format '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			compact = true;
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'H':
+			hotplug = true;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'e':
+			early = true;
+			break;
+		case 'd':
+			snprintf(device_path, sizeof device_path, "%s", optarg);
+			break;
+		case 't':
+			timings_path = optarg;
+			break;
+		case 'I': {
+			char *end;
+			unsigned long seconds = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || !seconds || seconds > UINT32_MAX) {
+				fprintf(stderr, "Invalid idle timeout '%s'\n", optarg);
+				return 1;
+			}
+			idle_timeout = seconds;
+			break;
+		}
+		case 'M':
+			idle_modeset = true;
+			break;
+		case 's':
+			if (strcmp(optarg, "none") == 0) {
+				scale_filter = SCALE_NONE;
+			} else if (strcmp(optarg, "nearest") == 0) {
+				scale_filter = SCALE_NEAREST;
+			} else if (strcmp(optarg, "bilinear") == 0) {
+				scale_filter = SCALE_BILINEAR;
+			} else {
+				fprintf(stderr, "Unknown scale filter '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	// Signals are only ever received through a signalfd in the event loop,
+	// so block their default handling for this and the daemonized process
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGHUP);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
+
+	fb_pool_init(&pool);
+
+	// card0 isn't necessarily the display controller, so unless told which
+	// device to use, go for the one with displays connected
+	start = timing_now();
+	int drm_fd = device_open(device_path, sizeof device_path);
+	if (drm_fd < 0)
+		return 1;
+	timing_record("open", device_path, start);
+
+	printf("Using %s\n", device_path);
+	fflush(stdout);
+
+	start = timing_now();
 	drmModeRes *res = drmModeGetResources(drm_fd);
 	if (!res) {
 		perror("drmModeGetResources");
 		return 1;
 	}
+	timing_record("get_resources", NULL, start);
+
+	struct splash_state state = {
+		.drm_fd = drm_fd,
+		.atomic = atomic && kms_enable_atomic(drm_fd),
+		.mode_policy = mode_policy,
+		.format = format,
+		.compact = compact,
+		.animate = animate,
+		.filter = scale_filter,
+		.fill_mode = fill_mode,
+		.foreground = 0xff000000 | foreground,
+		.background = 0xff000000 | background,
+		.hotplug = hotplug,
+		.progress = -1,
+		.idle_timeout = idle_timeout,
+		.idle_modeset = idle_modeset,
+		.idle = { .fd = -1, .dispatch = handle_idle },
+	};
+	state.idle.data = &state;
+	printf("Using %s modesetting\n", state.atomic ? "atomic" : "legacy");
+	printf("Using %s framebuffer writes\n", stream_impl());
+	fflush(stdout);
 
-	struct connector *conn_list = NULL;
-	uint32_t taken_crtcs = 0;
-
-	for (int i = 0; i < res->count_connectors; ++i) {
-		drmModeConnector *drm_conn = drmModeGetConnector(drm_fd, res->connectors[i]);
-		if (!drm_conn) {
-			perror("drmModeGetConnector");
-			continue;
+	// Load the splash image once; every display gets a copy of it. When
+	// going early, whoever provides it may not be up yet, so the displays
+	// are lit with the built-in image or just the fill until it comes.
+	struct image *splash = &state.image;
+	if (early) {
+		if (image_embedded(splash) && image_probe(splash)) {
+			printf("Using the built-in image until the splash is read\n");
+			fflush(stdout);
+		} else {
+			*splash = (struct image) { 0 };
 		}
+	}
 
-		struct connector *conn = malloc(sizeof *conn);
-		if (!conn) {
-			perror("malloc");
-			goto cleanup;
-		}
+	// Otherwise it's read on another thread while the connectors are
+	// probed, which can take a good while if they have to read EDID; it's
+	// first needed once the displays are laid out. Decoding ahead only
+	// pays off if the cache won't have the frames anyway. With --early the
+	// displays get the real splash after the fact, so it isn't cached.
+	struct read_job read_job = {
+		.path = image_path,
+		.fd = STDIN_FILENO,
+		.done_fd = -1,
+		.img = splash,
+		.decode = scale_filter != SCALE_NONE && !cache_dir,
+		.hash = cache_dir != NULL,
+	};
+	pthread_t reader;
+	bool reading = false;
+	if (!early) {
+		reading = pthread_create(&reader, NULL, read_image_job, &read_job) == 0;
+		if (!reading)
+			read_image_job(&read_job);
+	}
+
+	// Listen before probing, so nothing plugged in during bring-up is
+	// missed. Events for changes the probe already saw are no-ops.
+	struct hotplug hotplug_events = { .source.fd = -1 };
+	if (hotplug && !hotplug_init(&hotplug_events, drm_fd, handle_hotplug, &state))
+		fprintf(stderr, "Failed to listen for hotplug events\n");
+
+	// The kernel probes one connector of a device at a time, under its
+	// mode_config mutex, so there's nothing to gain from threads here
+	int num_probes = res->count_connectors;
+	struct probe_job *probes = calloc(num_probes ? num_probes : 1, sizeof *probes);
+	if (!probes) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (int i = 0; i < num_probes; ++i) {
+		probes[i].drm_fd = drm_fd;
+		probes[i].connector_id = res->connectors[i];
+		probe_connector(&probes[i]);
+	}
+
+	struct crtc_match *matches = calloc(num_probes ? num_probes : 1, sizeof *matches);
+	struct connector **matched = calloc(num_probes ? num_probes : 1, sizeof *matched);
+	if (!matches || !matched) {
+		perror("calloc");
+		return 1;
+	}
+
+	int num_matches = 0;
+	for (int i = 0; i < num_probes; ++i) {
+		drmModeConnector *drm_conn = probes[i].drm_conn;
+		if (!drm_conn)
+			continue;
 
-		conn->id = drm_conn->connector_id;
-		snprintf(conn->name, sizeof conn->name, "%s-%"PRIu32,
-				conn_str(drm_conn->connector_type),
-				drm_conn->connector_type_id);
+		struct connector *conn = new_connector(drm_conn);
+		if (!conn)
+			continue;
 		conn->connected = drm_conn->connection == DRM_MODE_CONNECTED;
 
-		conn->next = conn_list;
-		conn_list = conn;
+		conn->next = state.conn_list;
+		state.conn_list = conn;
 
 		printf("Found display %s\n", conn->name);
 		fflush(stdout);
@@ -258,96 +1744,433 @@ int main(void)
 		if (!conn->connected) {
 			printf("  Disconnected\n");
 			fflush(stdout);
-			goto cleanup;
+			continue;
 		}
 
 		if (drm_conn->count_modes == 0) {
 			printf("No valid modes\n");
 			fflush(stdout);
 			conn->connected = false;
-			goto cleanup;
+			continue;
 		}
 
-		conn->crtc_id = find_crtc(drm_fd, res, drm_conn, &taken_crtcs);
+		matches[num_matches].drm_conn = drm_conn;
+		matched[num_matches++] = conn;
+	}
+
+	// CRTCs are handed out for all connectors at once, so that one grabbing
+	// a CRTC first can't leave another without any
+	start = timing_now();
+	kms_assign_crtcs(drm_fd, res, matches, num_matches);
+	timing_record("assign_crtcs", NULL, start);
+
+	// The layout depends on the image size, so it has to be here now
+	start = timing_now();
+	if (reading)
+		pthread_join(reader, NULL);
+	timing_record("wait_image", NULL, start);
+
+	// Without an image there's nothing to set up, only to clean up
+	bool have_image = early || read_job.ok;
+	if (have_image && read_job.hash) {
+		state.cache_dir = cache_dir;
+		state.image_hash = read_job.hash_value;
+	}
+
+	for (int i = 0; i < num_matches && have_image; ++i) {
+		drmModeConnector *drm_conn = matches[i].drm_conn;
+		struct connector *conn = matched[i];
+
+		conn->current_crtc_id = matches[i].current_crtc_id;
+		conn->crtc_id = matches[i].crtc_id;
+		conn->crtc_index = matches[i].crtc_index;
 		if (!conn->crtc_id) {
 			fprintf(stderr, "Could not find CRTC for %s\n", conn->name);
 			conn->connected = false;
-			goto cleanup;
+			continue;
 		}
 
-		printf("  Using CRTC %"PRIu32"\n", conn->crtc_id);
-		fflush(stdout);
+		if (!setup_connector(&state, conn, drm_conn)) {
+			fprintf(stderr, "Falling back to legacy modesetting\n");
+			state.atomic = false;
+		}
+	}
 
-		// [0] is the best mode, so we'll just use that.
-		conn->mode = drm_conn->modes[0];
+	for (int i = 0; i < num_probes; ++i) {
+		if (probes[i].drm_conn)
+			drmModeFreeConnector(probes[i].drm_conn);
+	}
 
-		conn->width = conn->mode.hdisplay;
-		conn->height = conn->mode.vdisplay;
-		conn->rate = refresh_rate(&conn->mode);
+	free(matches);
+	free(matched);
+	free(probes);
+	drmModeFreeResources(res);
 
-		printf("  Using mode %"PRIu32"x%"PRIu32"@%"PRIu32"\n",
-				conn->width, conn->height, conn->rate);
-		fflush(stdout);
+	if (!have_image) {
+		hotplug_finish(&hotplug_events);
+		image_finish(splash);
+		while (state.conn_list) {
+			struct connector *next = state.conn_list->next;
+			free(state.conn_list);
+			state.conn_list = next;
+		}
+		return 1;
+	}
 
-		if (!create_fb(drm_fd, conn->width, conn->height, &conn->fb)) {
-			conn->connected = false;
-			goto cleanup;
+	// Allocate and fill every connector's framebuffers in parallel
+	int num_prepares = 0;
+	for (struct connector *conn = state.conn_list; conn; conn = conn->next)
+		num_prepares += conn->connected;
+
+	struct prepare_job *prepares = calloc(num_prepares ? num_prepares : 1, sizeof *prepares);
+	if (!prepares) {
+		perror("calloc");
+		return 1;
+	}
+
+	int n = 0;
+	for (struct connector *conn = state.conn_list; conn; conn = conn->next) {
+		if (!conn->connected)
+			continue;
+
+		choose_compact(&state, conn);
+
+		// Displays that will look the same as one before them get to
+		// share its framebuffer once it's there
+		bool twin = false;
+		for (struct connector *other = state.conn_list; other != conn && !twin;
+				other = other->next)
+			twin = other->connected && same_content(other, conn);
+		if (twin)
+			continue;
+
+		prepares[n++] = (struct prepare_job) {
+			.drm_fd = drm_fd,
+			.conn = conn,
+			.fill_mode = fill_mode,
+			.background = state.background,
+			.cache_dir = state.cache_dir,
+			.image_hash = state.image_hash,
+			.filter = scale_filter,
+		};
+	}
+	num_prepares = n;
+	run_parallel(prepare_connector, prepares, sizeof *prepares, num_prepares);
+
+	for (struct connector *conn = state.conn_list; conn; conn = conn->next) {
+		if (!conn->connected || conn->fb[0].id)
+			continue;
+
+		// Unless the one it was going to share with didn't work out
+		struct connector *twin = find_twin(state.conn_list, conn);
+		if (twin && share_fbs(drm_fd, conn, twin)) {
+			printf("%s: Sharing framebuffer %"PRIu32" with %s\n",
+					conn->name, conn->fb[0].id, twin->name);
+			continue;
 		}
 
-		printf("  Created framebuffer with ID %"PRIu32" (size: %"PRIu64" bytes)\n", 
-				conn->fb.id, conn->fb.size);
-		fflush(stdout);
+		struct prepare_job job = {
+			.drm_fd = drm_fd,
+			.conn = conn,
+			.fill_mode = fill_mode,
+			.background = state.background,
+			.cache_dir = state.cache_dir,
+			.image_hash = state.image_hash,
+			.filter = scale_filter,
+		};
+		prepares[num_prepares++] = job;
+		prepare_connector(&job);
+	}
 
-		// Load splash image from stdin into framebuffer
-		if (!load_splash_image_from_stdin(&conn->fb)) {
-			fprintf(stderr, "Failed to load splash image for %s\n", conn->name);
-			conn->connected = false;
-			goto cleanup;
+	for (int i = 0; i < num_prepares; ++i) {
+		struct connector *conn = prepares[i].conn;
+		if (!conn->connected)
+			continue;
+
+		for (int j = 0; j < conn->num_fbs; ++j) {
+			printf("%s: Created framebuffer with ID %"PRIu32" (size: %"PRIu64" bytes)\n",
+					conn->name, conn->fb[j].id, conn->fb[j].size);
+		}
+		if (conn->compact) {
+			printf("%s: Showing it on overlay plane %"PRIu32" at %"PRIu32",%"PRIu32"\n",
+					conn->name, conn->overlay_id, conn->plane_x, conn->plane_y);
 		}
+		if (conn->cached)
+			printf("%s: Loaded the splash from the cache\n", conn->name);
+
+		// Preparing may have fallen back to another format
+		if (conn->font && conn->font->format != conn->format)
+			setup_text(&state, conn);
+	}
+	fflush(stdout);
+	free(prepares);
+
+	// Copy the staged splash image into every framebuffer in one pass
+	start = timing_now();
+	if (!load_splash_image(state.conn_list, NULL, splash, scale_filter))
+		fprintf(stderr, "Failed to load splash image\n");
+	timing_record("load_image", NULL, start);
+
+	// Save the previous CRTC configurations. If one is already showing our
+	// mode on our connector, e.g. because firmware lit the panel, we can
+	// just swap in our framebuffer rather than doing a full modeset.
+	for (struct connector *conn = state.conn_list; conn; conn = conn->next) {
+		if (!conn->connected)
+			continue;
 
-		// Save the previous CRTC configuration
 		conn->saved = drmModeGetCrtc(drm_fd, conn->crtc_id);
+		conn->reuse_mode = conn->saved && conn->saved->mode_valid &&
+			conn->current_crtc_id == conn->crtc_id &&
+			mode_equal(&conn->saved->mode, &conn->mode);
 
-		// Perform the modeset
-		int ret = drmModeSetCrtc(drm_fd, conn->crtc_id, conn->fb.id, 0, 0,
-				&conn->id, 1, &conn->mode);
-		if (ret < 0) {
-			perror("drmModeSetCrtc");
+		if (conn->reuse_mode) {
+			printf("%s is already in our mode, skipping the modeset\n", conn->name);
+			fflush(stdout);
 		}
 
-cleanup:
-		drmModeFreeConnector(drm_conn);
+		// C8 pixels are palette indices, so the palette has to be in
+		// place before they are scanned out
+		if (conn->format == DRM_FORMAT_C8)
+			kms_load_palette(drm_fd, conn);
 	}
 
-	drmModeFreeResources(res);
+	// Perform the modeset: all displays at once if the driver lets us,
+	// otherwise one after the other
+	start = timing_now();
+	bool committed = state.atomic && kms_atomic_modeset(drm_fd, state.conn_list);
+	if (state.atomic)
+		timing_record("atomic_commit", NULL, start);
+
+	if (committed) {
+		printf("Lit all displays in one atomic commit\n");
+		fflush(stdout);
+	} else {
+		for (struct connector *conn = state.conn_list; conn; conn = conn->next) {
+			if (!conn->connected)
+				continue;
+
+			// A splash-sized framebuffer can't drive the CRTC by itself,
+			// so redo it full-screen, as when the driver rejects the layout
+			if (conn->compact) {
+				fprintf(stderr, "%s: Can't show the compact layout without atomic\n",
+						conn->name);
+				release_fbs(conn);
+				leave_compact(conn);
+
+				struct prepare_job job = {
+					.drm_fd = drm_fd,
+					.conn = conn,
+					.fill_mode = fill_mode,
+					.background = state.background,
+				};
+				prepare_connector(&job);
+				if (!conn->connected)
+					continue;
+				if (!load_splash_image(state.conn_list, conn, splash, scale_filter))
+					fprintf(stderr, "%s: Failed to load splash image\n", conn->name);
+			}
+
+			// The flip event kicks off the animation, if there is one
+			start = timing_now();
+			if (conn->reuse_mode && drmModePageFlip(drm_fd, conn->crtc_id,
+						conn->fb[0].id, DRM_MODE_PAGE_FLIP_EVENT, conn) == 0) {
+				timing_record("page_flip", conn->name, start);
+				conn->pending = 0;
+				continue;
+			}
+
+			int ret = drmModeSetCrtc(drm_fd, conn->crtc_id, conn->fb[0].id, 0, 0,
+					&conn->id, 1, &conn->mode);
+			if (ret < 0) {
+				perror("drmModeSetCrtc");
+				conn->animating = false;
+			}
+			timing_record("set_crtc", conn->name, start);
+		}
+	}
 
-	// Now daemonize after we've read from stdin
+	timing_record("bringup", NULL, main_start);
+
+	// Displays plugged in later need the image too, otherwise it can go now
+	if (!hotplug)
+		image_finish(splash);
+
+	// Without a commit that went through, the displays are on legacy
+	// modesetting from now on
+	state.atomic = committed;
+
+	// Once we daemonize, stderr is gone, so report now
+	if (timings_path)
+		timing_report(timings_path);
+
+	// Bind the control socket before the parent exits, so it's there by the
+	// time whoever started us carries on
+
+	struct control_handler handler = {
+		.progress = set_progress,
+		.image = set_image,
+		.dmabuf = set_dmabuf,
+		.message = set_message,
+		.stats = get_stats,
+		.data = &state,
+	};
+	struct control control = { .source.fd = -1 };
+	if (socket_path && !control_init(&control, socket_path, &handler))
+		fprintf(stderr, "Failed to create the control socket\n");
+
+	// With --early the real splash is read once we're running, by when
+	// daemonize() has put /dev/null on stdin
+	struct late_image late = {
+		.source = { .fd = -1, .dispatch = handle_late_image },
+		.state = &state,
+		.job = {
+			.path = image_path,
+			.fd = -1,
+			.decode = scale_filter != SCALE_NONE,
+			.wait = true,
+		},
+	};
+	late.job.img = &late.img;
+	if (early && !image_path) {
+		late.job.fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+		if (late.job.fd < 0)
+			perror("dup");
+	}
+
+	// Now daemonize, after we've read from stdin unless going early
 	printf("Daemonizing...\n");
 	fflush(stdout);
 	daemonize();
 
-	// Keep running until we receive a signal
-	while (keep_running) {
-		sleep(1);
+	// Nobody is waiting on us any more, so now is the time to save the
+	// frames that had to be rendered. They were copied as they were drawn,
+	// so nothing has to be read back from the framebuffers.
+	for (struct connector *conn = state.conn_list; conn; conn = conn->next) {
+		struct dumb_framebuffer *fb = &conn->fb[0];
+		if (conn->connected && fb->shadow) {
+			char path[4096];
+			cache_path(path, sizeof path, state.cache_dir, conn);
+
+			struct cache_key key;
+			cache_key_init(&key, conn, state.image_hash, fill_mode, state.background,
+					scale_filter);
+			cache_store(path, &key, fb->shadow, (size_t)fb->width * fb->cpp * fb->height);
+		}
+		fb_end_shadow(fb);
+	}
+
+	struct event_source drm_source = { .fd = drm_fd, .dispatch = handle_drm };
+	struct event_source signal_source = { .dispatch = handle_signal };
+
+	signal_source.fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (signal_source.fd < 0)
+		perror("signalfd");
+
+	if (signal_source.fd >= 0 && event_loop_init(&loop)) {
+		event_loop_add(&loop, &signal_source);
+		event_loop_add(&loop, &drm_source);
+		if (control.source.fd >= 0)
+			control_start(&control, &loop);
+		if (hotplug_events.source.fd >= 0)
+			event_loop_add(&loop, &hotplug_events.source);
+
+		// The displays are up and whoever started us has carried on, so
+		// now wait for the real splash, however long it takes to show up
+		if (early && (image_path || late.job.fd >= 0)) {
+			late.source.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			late.job.done_fd = late.source.fd;
+			if (late.source.fd < 0) {
+				perror("eventfd");
+			} else if (!event_loop_add(&loop, &late.source)) {
+				close(late.source.fd);
+				late.source.fd = -1;
+			} else if (pthread_create(&late.reader, NULL, read_image_job, &late.job) != 0) {
+				fprintf(stderr, "Failed to start reading the splash image\n");
+				event_loop_remove(&loop, &late.source);
+				close(late.source.fd);
+				late.source.fd = -1;
+			}
+		}
+
+		// Changing the mode of a lit display takes an atomic commit
+		if (state.idle_timeout && !state.atomic) {
+			fprintf(stderr, "Going idle needs atomic modesetting\n");
+		} else if (state.idle_timeout) {
+			state.idle.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if (state.idle.fd < 0)
+				perror("timerfd_create");
+			else if (event_loop_add(&loop, &state.idle))
+				arm_idle(&state);
+		}
+
+		// Start the animation, from here on driven by flip completion events
+		uint64_t start = now_ms();
+		for (struct connector *conn = state.conn_list; conn; conn = conn->next) {
+			if (conn->connected && conn->animating && conn->pending < 0)
+				queue_frame(drm_fd, conn, start);
+		}
+
+		// Sleep until we receive a signal or the display needs attention
+		event_loop_run(&loop);
+		event_loop_finish(&loop);
+	}
+
+	control_finish(&control);
+	hotplug_finish(&hotplug_events);
+	if (state.idle.fd >= 0)
+		close(state.idle.fd);
+	if (hotplug)
+		image_finish(splash);
+
+	// When keeping the splash, the compositor can become master and do its
+	// first flip from our framebuffer to its own, whenever it's ready
+	bool lingering = false;
+	if (keep) {
+		stop_animations(drm_fd, state.conn_list);
+		drmDropMaster(drm_fd);
+	}
+
+	// On screen is either an imported frame, or every display's front buffer
+	bool imported_shown = state.imported.id != 0;
+	if (imported_shown) {
+		if (keep)
+			lingering |= !release_imported_fb(drm_fd, &state.imported);
+		else
+			destroy_imported_fb(drm_fd, &state.imported, NULL);
 	}
+	bool keep_splash = keep && !imported_shown;
 
 	// Cleanup
-	struct connector *conn = conn_list;
+	struct connector *conn = state.conn_list;
 	while (conn) {
 		if (conn->connected) {
-			// Cleanup framebuffer
-			munmap(conn->fb.data, conn->fb.size);
-			drmModeRmFB(drm_fd, conn->fb.id);
-			struct drm_mode_destroy_dumb destroy = { .handle = conn->fb.handle };
-			drmIoctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+			// Give back the framebuffers, except for what's on screen if
+			// we keep it; the pool frees them all below
+			for (int i = 0; i < conn->num_fbs; ++i) {
+				if (!keep_splash || i != conn->front)
+					fb_pool_put(&pool, &conn->fb[i]);
+			}
+			if (conn->compact && !keep_splash)
+				fb_pool_put(&pool, &conn->background);
+
+			if (conn->mode_blob)
+				drmModeDestroyPropertyBlob(drm_fd, conn->mode_blob);
 
-			// Restore the old CRTC
 			drmModeCrtc *crtc = conn->saved;
-			if (crtc) {
-				drmModeSetCrtc(drm_fd, crtc->crtc_id, crtc->buffer_id,
-						crtc->x, crtc->y, &conn->id, 1, &crtc->mode);
-				drmModeFreeCrtc(crtc);
+			if (keep) {
+				// C8 framebuffers still need the palette
+				free(conn->saved_gamma);
+			} else {
+				kms_restore_gamma(drm_fd, conn);
+
+				// Restore the old CRTC
+				if (crtc) {
+					drmModeSetCrtc(drm_fd, crtc->crtc_id, crtc->buffer_id,
+							crtc->x, crtc->y, &conn->id, 1, &crtc->mode);
+				}
 			}
+			if (crtc)
+				drmModeFreeCrtc(crtc);
 		}
 
 		struct connector *tmp = conn->next;
@@ -355,6 +2178,20 @@ cleanup:
 		conn = tmp;
 	}
 
+	// Whatever is still referenced is on screen, and stays if we keep it
+	lingering |= !fb_pool_finish(&pool, drm_fd, keep_splash);
+	font_atlas_free(&state.atlases);
+
+	// Without CLOSEFB, closing the device would take our framebuffers off
+	// the screen, so hold on to it until we're told to go a second time
+	if (lingering && signal_source.fd >= 0) {
+		struct pollfd pfd = { .fd = signal_source.fd, .events = POLLIN };
+		while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+			;
+	}
+	if (signal_source.fd >= 0)
+		close(signal_source.fd);
+
 	close(drm_fd);
 	return 0;
 }
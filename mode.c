@@ -0,0 +1,172 @@
+#include "mode.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/*
+ * Parse "first", "preferred", "lowest" or "WxH[@Hz]", e.g. "1920x1080@59.94".
+ */
+bool mode_policy_parse(const char *str, struct mode_policy *policy)
+{
+	*policy = (struct mode_policy) { 0 };
+
+	if (strcmp(str, "first") == 0) {
+		policy->type = MODE_FIRST;
+		return true;
+	} else if (strcmp(str, "preferred") == 0) {
+		policy->type = MODE_PREFERRED;
+		return true;
+	} else if (strcmp(str, "lowest") == 0) {
+		policy->type = MODE_LOWEST;
+		return true;
+	}
+
+	char *end;
+	policy->type = MODE_EXACT;
+	policy->width = strtoul(str, &end, 10);
+	if (end == str || *end != 'x')
+		return false;
+
+	str = end + 1;
+	policy->height = strtoul(str, &end, 10);
+	if (end == str)
+		return false;
+
+	if (*end == '@') {
+		str = end + 1;
+		double hz = strtod(str, &end);
+		if (end == str || hz <= 0)
+			return false;
+		policy->rate = hz * 1000 + 0.5;
+	}
+
+	return *end == '\0' && policy->width && policy->height;
+}
+
+static const drmModeModeInfo *preferred_mode(const drmModeConnector *conn)
+{
+	for (int i = 0; i < conn->count_modes; ++i) {
+		if (conn->modes[i].type & DRM_MODE_TYPE_PREFERRED)
+			return &conn->modes[i];
+	}
+
+	return &conn->modes[0];
+}
+
+/*
+ * The native resolution at the lowest pixel clock, i.e. the least memory
+ * bandwidth spent on scanout. For a static image the lower refresh rate that
+ * usually comes with it doesn't matter.
+ */
+static const drmModeModeInfo *lowest_mode(const drmModeConnector *conn)
+{
+	const drmModeModeInfo *native = preferred_mode(conn);
+	const drmModeModeInfo *best = native;
+
+	for (int i = 0; i < conn->count_modes; ++i) {
+		const drmModeModeInfo *mode = &conn->modes[i];
+		if (mode->hdisplay != native->hdisplay || mode->vdisplay != native->vdisplay)
+			continue;
+
+		// Interlaced modes halve the clock, but flicker
+		if (mode->flags & DRM_MODE_FLAG_INTERLACE)
+			continue;
+
+		if (mode->clock < best->clock)
+			best = mode;
+	}
+
+	return best;
+}
+
+static const drmModeModeInfo *exact_mode(const drmModeConnector *conn,
+		const struct mode_policy *policy)
+{
+	const drmModeModeInfo *best = NULL;
+	uint32_t best_diff = UINT32_MAX;
+
+	for (int i = 0; i < conn->count_modes; ++i) {
+		drmModeModeInfo *mode = &conn->modes[i];
+		if (mode->hdisplay != policy->width || mode->vdisplay != policy->height)
+			continue;
+
+		// Without a rate, the first one in the driver's order wins
+		if (!policy->rate)
+			return mode;
+
+		int rate = refresh_rate(mode);
+		uint32_t diff = rate > (int)policy->rate ? rate - policy->rate : policy->rate - rate;
+		if (diff < best_diff) {
+			best = mode;
+			best_diff = diff;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Pick a mode of 'conn' according to 'policy'.
+ * If nothing matches, the preferred mode is used instead.
+ */
+const drmModeModeInfo *mode_select(const drmModeConnector *conn,
+		const struct mode_policy *policy)
+{
+	const drmModeModeInfo *mode = NULL;
+
+	switch (policy->type) {
+	case MODE_FIRST:
+		mode = &conn->modes[0];
+		break;
+	case MODE_PREFERRED:
+		mode = preferred_mode(conn);
+		break;
+	case MODE_LOWEST:
+		mode = lowest_mode(conn);
+		break;
+	case MODE_EXACT:
+		mode = exact_mode(conn, policy);
+		if (!mode) {
+			fprintf(stderr, "No %"PRIu32"x%"PRIu32" mode, using the preferred one\n",
+					policy->width, policy->height);
+			mode = preferred_mode(conn);
+		}
+		break;
+	}
+
+	return mode;
+}
+
+/*
+ * Pick the mode of 'conn' with the same resolution as 'current' but the
+ * lowest refresh rate, for when nothing on screen moves any more.
+ * NULL if none is slower than 'current'.
+ */
+const drmModeModeInfo *mode_select_idle(const drmModeConnector *conn,
+		const drmModeModeInfo *current)
+{
+	const drmModeModeInfo *best = NULL;
+	int best_rate = refresh_rate(current);
+
+	for (int i = 0; i < conn->count_modes; ++i) {
+		const drmModeModeInfo *mode = &conn->modes[i];
+		if (mode->hdisplay != current->hdisplay || mode->vdisplay != current->vdisplay)
+			continue;
+
+		// The image would visibly flicker
+		if (mode->flags & DRM_MODE_FLAG_INTERLACE)
+			continue;
+
+		int rate = refresh_rate(mode);
+		if (rate < best_rate) {
+			best = mode;
+			best_rate = rate;
+		}
+	}
+
+	return best;
+}
@@ -0,0 +1,44 @@
+#ifndef MODE_H
+#define MODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+enum mode_policy_type {
+	MODE_FIRST,     // whatever the driver lists first
+	MODE_PREFERRED, // the mode flagged DRM_MODE_TYPE_PREFERRED, usually native
+	MODE_LOWEST,    // native resolution at the lowest pixel clock
+	MODE_EXACT,     // a user-specified size, and optionally refresh rate
+};
+
+struct mode_policy {
+	enum mode_policy_type type;
+
+	// Only for MODE_EXACT
+	uint32_t width;
+	uint32_t height;
+	uint32_t rate; // mHz, 0 for any
+};
+
+/*
+ * Parse "first", "preferred", "lowest" or "WxH[@Hz]", e.g. "1920x1080@59.94".
+ */
+bool mode_policy_parse(const char *str, struct mode_policy *policy);
+
+/*
+ * Pick a mode of 'conn' according to 'policy'.
+ * If nothing matches, the preferred mode is used instead.
+ */
+const drmModeModeInfo *mode_select(const drmModeConnector *conn,
+		const struct mode_policy *policy);
+
+/*
+ * Pick the mode of 'conn' with the same resolution as 'current' but the
+ * lowest refresh rate, for when nothing on screen moves any more.
+ * NULL if none is slower than 'current'.
+ */
+const drmModeModeInfo *mode_select_idle(const drmModeConnector *conn,
+		const drmModeModeInfo *current);
+
+#endif
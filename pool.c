@@ -0,0 +1,126 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Framebuffers handed out by width, height and format. Displays showing
+ * the same thing can share one, and ones given back are kept around for
+ * the next display or animation that needs the same kind.
+ */
+void fb_pool_init(struct fb_pool *pool)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->entries = NULL;
+}
+
+static struct pool_entry *find_entry(struct fb_pool *pool, uint32_t fb_id)
+{
+	for (struct pool_entry *entry = pool->entries; entry; entry = entry->next) {
+		if (entry->fb.id == fb_id)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Get a framebuffer nobody else is using, like create_fb() would. One that
+ * was given back is reused if it matches, and 'fill' is applied to it.
+ */
+bool fb_pool_get(struct fb_pool *pool, int drm_fd, uint32_t width, uint32_t height,
+		uint32_t format, const struct fill_policy *fill, struct dumb_framebuffer *fb)
+{
+	pthread_mutex_lock(&pool->lock);
+	struct pool_entry *entry = pool->entries;
+	while (entry && (entry->refs || entry->fb.width != width ||
+				entry->fb.height != height || entry->fb.format != format))
+		entry = entry->next;
+	if (entry)
+		entry->refs = 1;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (entry) {
+		// Whatever was drawn into it last is still there, so what the
+		// image won't cover has to be cleared as if freshly allocated
+		struct fill_policy refill = *fill;
+		if (refill.mode == FILL_NONE) {
+			refill.mode = FILL_MARGINS;
+			refill.color = 0;
+		}
+		*fb = entry->fb;
+		fill_fb(fb, &refill);
+		return true;
+	}
+
+	// Allocating doesn't need the lock, and may take a while
+	entry = malloc(sizeof *entry);
+	if (!entry) {
+		perror("malloc");
+		return false;
+	}
+
+	if (!create_fb(drm_fd, width, height, format, fill, &entry->fb)) {
+		free(entry);
+		return false;
+	}
+	entry->refs = 1;
+	*fb = entry->fb;
+
+	pthread_mutex_lock(&pool->lock);
+	entry->next = pool->entries;
+	pool->entries = entry;
+	pthread_mutex_unlock(&pool->lock);
+	return true;
+}
+
+/*
+ * Take another reference to 'fb', for one more display to scan out of.
+ */
+void fb_pool_ref(struct fb_pool *pool, const struct dumb_framebuffer *fb)
+{
+	pthread_mutex_lock(&pool->lock);
+	struct pool_entry *entry = find_entry(pool, fb->id);
+	if (entry)
+		entry->refs++;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Give back a reference to 'fb'. Once there are none left, it's kept
+ * for fb_pool_get() to hand out again.
+ */
+void fb_pool_put(struct fb_pool *pool, const struct dumb_framebuffer *fb)
+{
+	pthread_mutex_lock(&pool->lock);
+	struct pool_entry *entry = find_entry(pool, fb->id);
+	if (entry && entry->refs > 0)
+		entry->refs--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Free every framebuffer in the pool. The ones still referenced are on
+ * screen: with 'keep' they're released with release_fb() so they stay
+ * there, and false is returned if any of them couldn't be.
+ */
+bool fb_pool_finish(struct fb_pool *pool, int drm_fd, bool keep)
+{
+	bool ok = true;
+
+	struct pool_entry *entry = pool->entries;
+	while (entry) {
+		if (keep && entry->refs)
+			ok &= release_fb(drm_fd, &entry->fb);
+		else
+			destroy_fb(drm_fd, &entry->fb);
+
+		struct pool_entry *tmp = entry->next;
+		free(entry);
+		entry = tmp;
+	}
+
+	pool->entries = NULL;
+	pthread_mutex_destroy(&pool->lock);
+	return ok;
+}
@@ -0,0 +1,53 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fb.h"
+
+struct pool_entry {
+	struct dumb_framebuffer fb;
+	int refs; // users of the framebuffer, or 0 if it's waiting to be reused
+	struct pool_entry *next;
+};
+
+/*
+ * Framebuffers handed out by width, height and format. Displays showing
+ * the same thing can share one, and ones given back are kept around for
+ * the next display or animation that needs the same kind.
+ */
+struct fb_pool {
+	pthread_mutex_t lock; // framebuffers are set up from several threads
+	struct pool_entry *entries;
+};
+
+void fb_pool_init(struct fb_pool *pool);
+
+/*
+ * Get a framebuffer nobody else is using, like create_fb() would. One that
+ * was given back is reused if it matches, and 'fill' is applied to it.
+ */
+bool fb_pool_get(struct fb_pool *pool, int drm_fd, uint32_t width, uint32_t height,
+		uint32_t format, const struct fill_policy *fill, struct dumb_framebuffer *fb);
+
+/*
+ * Take another reference to 'fb', for one more display to scan out of.
+ */
+void fb_pool_ref(struct fb_pool *pool, const struct dumb_framebuffer *fb);
+
+/*
+ * Give back a reference to 'fb'. Once there are none left, it's kept
+ * for fb_pool_get() to hand out again.
+ */
+void fb_pool_put(struct fb_pool *pool, const struct dumb_framebuffer *fb);
+
+/*
+ * Free every framebuffer in the pool. The ones still referenced are on
+ * screen: with 'keep' they're released with release_fb() so they stay
+ * there, and false is returned if any of them couldn't be.
+ */
+bool fb_pool_finish(struct fb_pool *pool, int drm_fd, bool keep);
+
+#endif
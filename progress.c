@@ -0,0 +1,87 @@
+#include "progress.h"
+
+// Time for the busy indicator to sweep across the bar and back
+#define BUSY_PERIOD_MS 2000
+
+/*
+ * Lay a progress bar out centred along the lower part of a
+ * 'width' x 'height' framebuffer.
+ */
+void progress_bar_init(struct progress_bar *bar, uint32_t width, uint32_t height,
+		uint32_t fg, uint32_t bg)
+{
+	bar->width = width / 3;
+	bar->height = height / 120 > 4 ? height / 120 : 4;
+	if (bar->height > height)
+		bar->height = height;
+	bar->x = (width - bar->width) / 2;
+	bar->y = (height - bar->height) * 5 / 6;
+	bar->fg = fg;
+	bar->bg = bg;
+	bar->filled = -1;
+}
+
+static void set_clip(drmModeClip *clip, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height)
+{
+	clip->x1 = x;
+	clip->y1 = y;
+	clip->x2 = x + width;
+	clip->y2 = y + height;
+}
+
+/*
+ * Draw the bar 'percent' full. Only the columns that changed since the last
+ * call are written, and 'clip' is set to cover them for fb_flush().
+ * Returns false if nothing changed.
+ */
+bool progress_bar_draw(struct progress_bar *bar, struct dumb_framebuffer *fb,
+		uint32_t percent, drmModeClip *clip)
+{
+	if (percent > 100)
+		percent = 100;
+	int32_t filled = (uint64_t)bar->width * percent / 100;
+
+	if (bar->filled < 0) {
+		fill_rect(fb, bar->x, bar->y, filled, bar->height, bar->fg);
+		fill_rect(fb, bar->x + filled, bar->y, bar->width - filled, bar->height, bar->bg);
+		set_clip(clip, bar->x, bar->y, bar->width, bar->height);
+	} else if (filled > bar->filled) {
+		fill_rect(fb, bar->x + bar->filled, bar->y, filled - bar->filled, bar->height, bar->fg);
+		set_clip(clip, bar->x + bar->filled, bar->y, filled - bar->filled, bar->height);
+	} else if (filled < bar->filled) {
+		fill_rect(fb, bar->x + filled, bar->y, bar->filled - filled, bar->height, bar->bg);
+		set_clip(clip, bar->x + filled, bar->y, bar->filled - filled, bar->height);
+	} else {
+		return false;
+	}
+
+	bar->filled = filled;
+	return true;
+}
+
+/*
+ * Draw the indeterminate "busy" animation as it looks at 'time_ms'.
+ * Only the bar's own rectangle is written, and every pixel of it once.
+ * 'clip', unless it's NULL, is set to that rectangle.
+ */
+void progress_bar_draw_busy(struct progress_bar *bar, struct dumb_framebuffer *fb,
+		uint64_t time_ms, drmModeClip *clip)
+{
+	uint32_t block = bar->width / 4;
+	uint32_t travel = bar->width - block;
+
+	// Ping-pong from one end of the bar to the other
+	uint32_t t = time_ms % BUSY_PERIOD_MS;
+	if (t > BUSY_PERIOD_MS / 2)
+		t = BUSY_PERIOD_MS - t;
+	uint32_t pos = (uint64_t)travel * t / (BUSY_PERIOD_MS / 2);
+
+	fill_rect(fb, bar->x, bar->y, pos, bar->height, bar->bg);
+	fill_rect(fb, bar->x + pos, bar->y, block, bar->height, bar->fg);
+	fill_rect(fb, bar->x + pos + block, bar->y, travel - pos, bar->height, bar->bg);
+
+	if (clip)
+		set_clip(clip, bar->x, bar->y, bar->width, bar->height);
+	bar->filled = -1;
+}
@@ -0,0 +1,46 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "fb.h"
+
+/*
+ * A horizontal progress bar drawn straight into a framebuffer.
+ */
+struct progress_bar {
+	uint32_t x, y;
+	uint32_t width, height;
+	uint32_t fg, bg; // XRGB8888
+
+	// Width of the filled part as last drawn, or -1 if the framebuffer
+	// doesn't hold a determinate bar (yet)
+	int32_t filled;
+};
+
+/*
+ * Lay a progress bar out centred along the lower part of a
+ * 'width' x 'height' framebuffer.
+ */
+void progress_bar_init(struct progress_bar *bar, uint32_t width, uint32_t height,
+		uint32_t fg, uint32_t bg);
+
+/*
+ * Draw the bar 'percent' full. Only the columns that changed since the last
+ * call are written, and 'clip' is set to cover them for fb_flush().
+ * Returns false if nothing changed.
+ */
+bool progress_bar_draw(struct progress_bar *bar, struct dumb_framebuffer *fb,
+		uint32_t percent, drmModeClip *clip);
+
+/*
+ * Draw the indeterminate "busy" animation as it looks at 'time_ms'.
+ * Only the bar's own rectangle is written, and every pixel of it once.
+ * 'clip', unless it's NULL, is set to that rectangle.
+ */
+void progress_bar_draw_busy(struct progress_bar *bar, struct dumb_framebuffer *fb,
+		uint64_t time_ms, drmModeClip *clip);
+
+#endif
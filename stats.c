@@ -0,0 +1,77 @@
+#include "stats.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Start counting for a CRTC refreshing at 'rate' mHz.
+ */
+void flip_stats_init(struct flip_stats *stats, uint32_t rate)
+{
+	memset(stats, 0, sizeof *stats);
+	stats->period_us = rate ? 1000000000ull / rate : 0;
+}
+
+/*
+ * Drawing of the next frame started at 'time_us' (CLOCK_MONOTONIC).
+ */
+void flip_stats_render(struct flip_stats *stats, uint64_t time_us)
+{
+	stats->render_us = time_us;
+}
+
+/*
+ * A flip landed on vblank 'sequence' at 'time_us', as the flip event says.
+ */
+void flip_stats_flip(struct flip_stats *stats, uint32_t sequence, uint64_t time_us)
+{
+	if (stats->render_us && time_us >= stats->render_us) {
+		uint64_t latency = time_us - stats->render_us;
+		stats->latency_sum_us += latency;
+		if (latency > stats->latency_max_us)
+			stats->latency_max_us = latency;
+		stats->latencies++;
+	}
+	stats->render_us = 0;
+
+	if (stats->flips) {
+		// The vblank counter is exact; drivers without one report the
+		// same sequence every time, so fall back to the timestamps then
+		uint32_t vblanks = sequence - stats->last_sequence;
+		if (vblanks == 0 && stats->period_us) {
+			uint64_t interval = time_us - stats->last_us;
+			vblanks = (interval + stats->period_us / 2) / stats->period_us;
+		}
+		if (vblanks == 0)
+			vblanks = 1;
+
+		stats->missed += vblanks - 1;
+		stats->intervals[vblanks < STATS_BUCKETS ? vblanks - 1 : STATS_BUCKETS - 1]++;
+	}
+
+	stats->flips++;
+	stats->last_sequence = sequence;
+	stats->last_us = time_us;
+}
+
+/*
+ * Describe 'stats' on a single line, e.g.
+ *   HDMI-A-1 period_us=16666 flips=600 missed=2 intervals=598,1,0,0,0 latency_avg_us=812 latency_max_us=4210
+ * Returns what snprintf() does.
+ */
+int flip_stats_format(const struct flip_stats *stats, const char *name, char *buf, size_t size)
+{
+	char intervals[STATS_BUCKETS * 21];
+	size_t len = 0;
+	for (int i = 0; i < STATS_BUCKETS; ++i) {
+		len += snprintf(intervals + len, sizeof intervals - len, "%s%"PRIu64,
+				i ? "," : "", stats->intervals[i]);
+	}
+
+	uint64_t avg = stats->latencies ? stats->latency_sum_us / stats->latencies : 0;
+	return snprintf(buf, size, "%s period_us=%"PRIu32" flips=%"PRIu64" missed=%"PRIu64
+			" intervals=%s latency_avg_us=%"PRIu64" latency_max_us=%"PRIu64"\n",
+			name, stats->period_us, stats->flips, stats->missed, intervals,
+			avg, stats->latency_max_us);
+}
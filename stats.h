@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Frame intervals are counted in vblanks: 1, 2, ... and this many or more
+#define STATS_BUCKETS 5
+
+/*
+ * How page flips on one CRTC kept up with its refresh rate.
+ */
+struct flip_stats {
+	uint32_t period_us; // expected time per frame, from the mode
+
+	uint64_t flips;
+	uint64_t missed; // vblanks that went by without a new frame
+
+	// Flips by how many vblanks after the one before they landed
+	uint64_t intervals[STATS_BUCKETS];
+
+	// From starting to draw a frame until it was on screen
+	uint64_t latency_sum_us;
+	uint64_t latency_max_us;
+	uint64_t latencies;
+
+	uint64_t render_us;     // when drawing of the pending frame started, or 0
+	uint32_t last_sequence; // of the last flip, if 'flips' isn't 0
+	uint64_t last_us;
+};
+
+/*
+ * Start counting for a CRTC refreshing at 'rate' mHz.
+ */
+void flip_stats_init(struct flip_stats *stats, uint32_t rate);
+
+/*
+ * Drawing of the next frame started at 'time_us' (CLOCK_MONOTONIC).
+ */
+void flip_stats_render(struct flip_stats *stats, uint64_t time_us);
+
+/*
+ * A flip landed on vblank 'sequence' at 'time_us', as the flip event says.
+ */
+void flip_stats_flip(struct flip_stats *stats, uint32_t sequence, uint64_t time_us);
+
+/*
+ * Describe 'stats' on a single line, e.g.
+ *   HDMI-A-1 period_us=16666 flips=600 missed=2 intervals=598,1,0,0,0 latency_avg_us=812 latency_max_us=4210
+ * Returns what snprintf() does.
+ */
+int flip_stats_format(const struct flip_stats *stats, const char *name, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,231 @@
+#include "stream.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+// Below this much, lining up for vector stores costs more than it saves
+#define STREAM_MIN 64
+
+/*
+ * Byte 'i' of a fill at 'dst', per stream_fill().
+ */
+static uint8_t pattern_byte(uint32_t pattern, uintptr_t addr)
+{
+	return pattern >> (addr % 4 * 8);
+}
+
+/*
+ * Write the bytes of a fill at 'dst' one by one, for the unaligned ends.
+ */
+static void fill_bytes(uint8_t *dst, uint32_t pattern, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		dst[i] = pattern_byte(pattern, (uintptr_t)(dst + i));
+}
+
+static void copy_generic(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+static void fill_generic(uint8_t *dst, uint32_t pattern, size_t size)
+{
+	size_t head = -(uintptr_t)dst & 3;
+	if (head > size)
+		head = size;
+	fill_bytes(dst, pattern, head);
+	dst += head;
+	size -= head;
+
+	// Now 4-byte aligned, so the pattern lines up with every word
+	uint32_t *words = (uint32_t *)dst;
+	for (size_t i = 0; i < size / 4; ++i)
+		words[i] = pattern;
+
+	fill_bytes(dst + size / 4 * 4, pattern, size % 4);
+}
+
+#ifdef HAVE_SSE2
+/*
+ * movntdq wants 16-byte aligned destinations, so the unaligned head and the
+ * tail go through plain stores, and everything in between is streamed.
+ */
+__attribute__((target("sse2")))
+static void copy_sse2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	size_t head = -(uintptr_t)dst & 15;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+	}
+	for (; size >= 16; size -= 16, dst += 16, src += 16)
+		_mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+
+	memcpy(dst, src, size);
+
+	// Streaming stores are weakly ordered, so make sure they've all landed
+	// before whoever comes next, e.g. a flip, looks at the buffer
+	_mm_sfence();
+}
+
+__attribute__((target("sse2")))
+static void fill_sse2(uint8_t *dst, uint32_t pattern, size_t size)
+{
+	size_t head = -(uintptr_t)dst & 15;
+	fill_bytes(dst, pattern, head);
+	dst += head;
+	size -= head;
+
+	// 'dst' is 16-byte aligned now, so every lane starts at byte 0
+	__m128i v = _mm_set1_epi32(pattern);
+	for (; size >= 64; size -= 64, dst += 64) {
+		_mm_stream_si128((__m128i *)dst, v);
+		_mm_stream_si128((__m128i *)(dst + 16), v);
+		_mm_stream_si128((__m128i *)(dst + 32), v);
+		_mm_stream_si128((__m128i *)(dst + 48), v);
+	}
+	for (; size >= 16; size -= 16, dst += 16)
+		_mm_stream_si128((__m128i *)dst, v);
+
+	fill_bytes(dst, pattern, size);
+	_mm_sfence();
+}
+#endif
+
+#ifdef HAVE_NEON
+/*
+ * Store 32 bytes at 'dst'. AArch64 has a non-temporal store pair for this;
+ * 32-bit ARM doesn't, but full sequential lines still combine.
+ */
+static inline void store32_neon(uint8_t *dst, uint8x16_t a, uint8x16_t b)
+{
+#ifdef __aarch64__
+	__asm__ volatile("stnp %q0, %q1, [%2]" : : "w"(a), "w"(b), "r"(dst) : "memory");
+#else
+	vst1q_u8(dst, a);
+	vst1q_u8(dst + 16, b);
+#endif
+}
+
+static void copy_neon(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	size_t head = -(uintptr_t)dst & 15;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, dst += 64, src += 64) {
+		store32_neon(dst, vld1q_u8(src), vld1q_u8(src + 16));
+		store32_neon(dst + 32, vld1q_u8(src + 32), vld1q_u8(src + 48));
+	}
+	for (; size >= 32; size -= 32, dst += 32, src += 32)
+		store32_neon(dst, vld1q_u8(src), vld1q_u8(src + 16));
+
+	memcpy(dst, src, size);
+}
+
+static void fill_neon(uint8_t *dst, uint32_t pattern, size_t size)
+{
+	size_t head = -(uintptr_t)dst & 15;
+	fill_bytes(dst, pattern, head);
+	dst += head;
+	size -= head;
+
+	uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(pattern));
+	for (; size >= 32; size -= 32, dst += 32)
+		store32_neon(dst, v, v);
+
+	fill_bytes(dst, pattern, size);
+}
+#endif
+
+static struct {
+	const char *name;
+	void (*copy)(uint8_t *dst, const uint8_t *src, size_t size);
+	void (*fill)(uint8_t *dst, uint32_t pattern, size_t size);
+} impl = { "generic", copy_generic, fill_generic };
+
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Pick the implementation for the CPU we're running on, rather than the one
+ * we were built for, so one binary does the right thing on every board.
+ */
+static void pick_impl(void)
+{
+#ifdef HAVE_SSE2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		impl.name = "sse2";
+		impl.copy = copy_sse2;
+		impl.fill = fill_sse2;
+	}
+#elif defined(HAVE_NEON)
+	// Only built when the compiler may assume NEON anyway
+	impl.name = "neon";
+	impl.copy = copy_neon;
+	impl.fill = fill_neon;
+#endif
+}
+
+/*
+ * Copy 'size' bytes into a write-combined framebuffer mapping at 'dst'.
+ * Where the CPU has them, non-temporal stores write whole cache lines
+ * straight to memory, without reading 'dst' or filling the cache with it.
+ */
+void stream_copy(void *dst, const void *src, size_t size)
+{
+	if (size < STREAM_MIN) {
+		memcpy(dst, src, size);
+		return;
+	}
+
+	pthread_once(&impl_once, pick_impl);
+	impl.copy(dst, src, size);
+}
+
+/*
+ * Fill 'size' bytes at 'dst' with 'pattern', the way stream_copy() writes.
+ * Byte 'i' of the result is byte '(dst + i) % 4' of the little-endian
+ * 'pattern', so for pixels of 1, 2 or 4 bytes it should hold the pixel
+ * repeated to fill 32 bits, and 'dst' should be aligned to a pixel.
+ */
+void stream_fill(void *dst, uint32_t pattern, size_t size)
+{
+	if (size < STREAM_MIN) {
+		fill_generic(dst, pattern, size);
+		return;
+	}
+
+	pthread_once(&impl_once, pick_impl);
+	impl.fill(dst, pattern, size);
+}
+
+/*
+ * Which implementation the CPU got: "sse2", "neon" or "generic".
+ */
+const char *stream_impl(void)
+{
+	pthread_once(&impl_once, pick_impl);
+	return impl.name;
+}
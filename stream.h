@@ -0,0 +1,27 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Copy 'size' bytes into a write-combined framebuffer mapping at 'dst'.
+ * Where the CPU has them, non-temporal stores write whole cache lines
+ * straight to memory, without reading 'dst' or filling the cache with it.
+ */
+void stream_copy(void *dst, const void *src, size_t size);
+
+/*
+ * Fill 'size' bytes at 'dst' with 'pattern', the way stream_copy() writes.
+ * Byte 'i' of the result is byte '(dst + i) % 4' of the little-endian
+ * 'pattern', so for pixels of 1, 2 or 4 bytes it should hold the pixel
+ * repeated to fill 32 bits, and 'dst' should be aligned to a pixel.
+ */
+void stream_fill(void *dst, uint32_t pattern, size_t size);
+
+/*
+ * Which implementation the CPU got: "sse2", "neon" or "generic".
+ */
+const char *stream_impl(void);
+
+#endif
@@ -0,0 +1,276 @@
+#include "text.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream.h"
+
+#define GLYPH_WIDTH 5
+#define GLYPH_HEIGHT 7
+
+// Each glyph gets a column to its right and a row above and below
+#define CELL_WIDTH (GLYPH_WIDTH + 1)
+#define CELL_HEIGHT (GLYPH_HEIGHT + 2)
+
+#define FIRST_GLYPH ' '
+#define LAST_GLYPH '~'
+#define NUM_GLYPHS (LAST_GLYPH - FIRST_GLYPH + 1)
+
+// Printable ASCII, one byte per row with the leftmost pixel in bit 4
+static const uint8_t font[NUM_GLYPHS][GLYPH_HEIGHT] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // ' '
+	{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 }, // '!'
+	{ 0x0a, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00 }, // '"'
+	{ 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a }, // '#'
+	{ 0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04 }, // '$'
+	{ 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 }, // '%'
+	{ 0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d }, // '&'
+	{ 0x04, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00 }, // '\''
+	{ 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 }, // '('
+	{ 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 }, // ')'
+	{ 0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00 }, // '*'
+	{ 0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00 }, // '+'
+	{ 0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08 }, // ','
+	{ 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 }, // '-'
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c }, // '.'
+	{ 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 }, // '/'
+	{ 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e }, // '0'
+	{ 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e }, // '1'
+	{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f }, // '2'
+	{ 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e }, // '3'
+	{ 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 }, // '4'
+	{ 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e }, // '5'
+	{ 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e }, // '6'
+	{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 }, // '7'
+	{ 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e }, // '8'
+	{ 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c }, // '9'
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 }, // ':'
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08 }, // ';'
+	{ 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 }, // '<'
+	{ 0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00 }, // '='
+	{ 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 }, // '>'
+	{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 }, // '?'
+	{ 0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e }, // '@'
+	{ 0x0e, 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11 }, // 'A'
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e }, // 'B'
+	{ 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e }, // 'C'
+	{ 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c }, // 'D'
+	{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f }, // 'E'
+	{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 }, // 'F'
+	{ 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f }, // 'G'
+	{ 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 }, // 'H'
+	{ 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e }, // 'I'
+	{ 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c }, // 'J'
+	{ 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 }, // 'K'
+	{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f }, // 'L'
+	{ 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 }, // 'M'
+	{ 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 }, // 'N'
+	{ 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e }, // 'O'
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 }, // 'P'
+	{ 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d }, // 'Q'
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 }, // 'R'
+	{ 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e }, // 'S'
+	{ 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, // 'T'
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e }, // 'U'
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 }, // 'V'
+	{ 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a }, // 'W'
+	{ 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 }, // 'X'
+	{ 0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04 }, // 'Y'
+	{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f }, // 'Z'
+	{ 0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e }, // '['
+	{ 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 }, // '\\'
+	{ 0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e }, // ']'
+	{ 0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00 }, // '^'
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f }, // '_'
+	{ 0x08, 0x04, 0x02, 0x00, 0x00, 0x00, 0x00 }, // '`'
+	{ 0x00, 0x00, 0x0e, 0x01, 0x0f, 0x11, 0x0f }, // 'a'
+	{ 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x1e }, // 'b'
+	{ 0x00, 0x00, 0x0e, 0x10, 0x10, 0x11, 0x0e }, // 'c'
+	{ 0x01, 0x01, 0x0d, 0x13, 0x11, 0x11, 0x0f }, // 'd'
+	{ 0x00, 0x00, 0x0e, 0x11, 0x1f, 0x10, 0x0e }, // 'e'
+	{ 0x06, 0x09, 0x08, 0x1c, 0x08, 0x08, 0x08 }, // 'f'
+	{ 0x00, 0x0f, 0x11, 0x11, 0x0f, 0x01, 0x0e }, // 'g'
+	{ 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11 }, // 'h'
+	{ 0x04, 0x00, 0x0c, 0x04, 0x04, 0x04, 0x0e }, // 'i'
+	{ 0x02, 0x00, 0x06, 0x02, 0x02, 0x12, 0x0c }, // 'j'
+	{ 0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12 }, // 'k'
+	{ 0x0c, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e }, // 'l'
+	{ 0x00, 0x00, 0x1a, 0x15, 0x15, 0x11, 0x11 }, // 'm'
+	{ 0x00, 0x00, 0x16, 0x19, 0x11, 0x11, 0x11 }, // 'n'
+	{ 0x00, 0x00, 0x0e, 0x11, 0x11, 0x11, 0x0e }, // 'o'
+	{ 0x00, 0x00, 0x1e, 0x11, 0x1e, 0x10, 0x10 }, // 'p'
+	{ 0x00, 0x00, 0x0d, 0x13, 0x0f, 0x01, 0x01 }, // 'q'
+	{ 0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10 }, // 'r'
+	{ 0x00, 0x00, 0x0e, 0x10, 0x0e, 0x01, 0x1e }, // 's'
+	{ 0x08, 0x08, 0x1c, 0x08, 0x08, 0x09, 0x06 }, // 't'
+	{ 0x00, 0x00, 0x11, 0x11, 0x11, 0x13, 0x0d }, // 'u'
+	{ 0x00, 0x00, 0x11, 0x11, 0x11, 0x0a, 0x04 }, // 'v'
+	{ 0x00, 0x00, 0x11, 0x11, 0x15, 0x15, 0x0a }, // 'w'
+	{ 0x00, 0x00, 0x11, 0x0a, 0x04, 0x0a, 0x11 }, // 'x'
+	{ 0x00, 0x00, 0x11, 0x11, 0x0f, 0x01, 0x0e }, // 'y'
+	{ 0x00, 0x00, 0x1f, 0x02, 0x04, 0x08, 0x1f }, // 'z'
+	{ 0x02, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02 }, // '{'
+	{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, // '|'
+	{ 0x08, 0x04, 0x04, 0x02, 0x04, 0x04, 0x08 }, // '}'
+	{ 0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00 }, // '~'
+};
+
+static size_t cell_size(const struct font_atlas *atlas)
+{
+	return (size_t)atlas->cell_width * atlas->cell_height * atlas->cpp;
+}
+
+static void put_pixel(uint8_t *dst, uint32_t cpp, uint32_t pixel)
+{
+	if (cpp == 1)
+		*dst = pixel;
+	else if (cpp == 2)
+		memcpy(dst, &(uint16_t) { pixel }, 2);
+	else
+		memcpy(dst, &pixel, 4);
+}
+
+/*
+ * Render every glyph of the font into 'atlas', scaled up and converted to
+ * its format. This is the only time the font bitmap is looked at.
+ */
+static void render_atlas(struct font_atlas *atlas)
+{
+	uint32_t fg = format_pixel(atlas->format, atlas->fg);
+	uint32_t bg = format_pixel(atlas->format, atlas->bg);
+	uint8_t *dst = atlas->pixels;
+
+	for (int g = 0; g < NUM_GLYPHS; ++g) {
+		for (uint32_t y = 0; y < atlas->cell_height; ++y) {
+			int row = (int)(y / atlas->scale) - 1;
+			uint8_t bits = row >= 0 && row < GLYPH_HEIGHT ? font[g][row] : 0;
+
+			for (uint32_t x = 0; x < atlas->cell_width; ++x) {
+				uint32_t col = x / atlas->scale;
+				bool set = col < GLYPH_WIDTH && (bits >> (GLYPH_WIDTH - 1 - col)) & 1;
+				put_pixel(dst, atlas->cpp, set ? fg : bg);
+				dst += atlas->cpp;
+			}
+		}
+	}
+}
+
+/*
+ * Find the atlas with the given format, size and colours in 'cache', or
+ * render it and add it there. Displays with the same format and size
+ * share one. Returns NULL if it couldn't be allocated.
+ */
+const struct font_atlas *font_atlas_get(struct font_atlas **cache, uint32_t format,
+		uint32_t scale, uint32_t fg, uint32_t bg)
+{
+	for (struct font_atlas *atlas = *cache; atlas; atlas = atlas->next) {
+		if (atlas->format == format && atlas->scale == scale &&
+				atlas->fg == fg && atlas->bg == bg)
+			return atlas;
+	}
+
+	struct font_atlas *atlas = calloc(1, sizeof *atlas);
+	if (!atlas) {
+		perror("calloc");
+		return NULL;
+	}
+
+	atlas->format = format;
+	atlas->scale = scale;
+	atlas->fg = fg;
+	atlas->bg = bg;
+	atlas->cell_width = CELL_WIDTH * scale;
+	atlas->cell_height = CELL_HEIGHT * scale;
+	atlas->cpp = format_cpp(format);
+
+	atlas->pixels = malloc(cell_size(atlas) * NUM_GLYPHS);
+	if (!atlas->pixels) {
+		perror("malloc");
+		free(atlas);
+		return NULL;
+	}
+	render_atlas(atlas);
+
+	atlas->next = *cache;
+	*cache = atlas;
+	return atlas;
+}
+
+void font_atlas_free(struct font_atlas **cache)
+{
+	struct font_atlas *atlas = *cache;
+	while (atlas) {
+		struct font_atlas *next = atlas->next;
+		free(atlas->pixels);
+		free(atlas);
+		atlas = next;
+	}
+
+	*cache = NULL;
+}
+
+/*
+ * Lay out a line of 'atlas' glyphs across a 'width' x 'height' framebuffer,
+ * with its top at 'y'.
+ */
+void text_line_init(struct text_line *line, const struct font_atlas *atlas,
+		uint32_t width, uint32_t height, uint32_t y)
+{
+	memset(line, 0, sizeof *line);
+	if (!atlas || y >= height || height - y < atlas->cell_height)
+		return;
+
+	line->length = width / atlas->cell_width;
+	if (line->length > TEXT_MAX_LENGTH)
+		line->length = TEXT_MAX_LENGTH;
+	line->x = (width - line->length * atlas->cell_width) / 2;
+	line->y = y;
+}
+
+/*
+ * Show 'text', centred and cut short if it doesn't fit, replacing whatever
+ * the line showed before. Only the cells that changed are written, and
+ * 'clip' is set to cover them for fb_flush(). Returns false if nothing did.
+ */
+bool text_draw(const struct font_atlas *atlas, struct text_line *line,
+		struct dumb_framebuffer *fb, const char *text, drmModeClip *clip)
+{
+	size_t len = strlen(text);
+	if (len > line->length)
+		len = line->length;
+	uint32_t start = (line->length - len) / 2;
+
+	uint32_t first = 0, last = 0;
+	bool changed = false;
+	for (uint32_t i = 0; i < line->length; ++i) {
+		char c = i >= start && i < start + len ? text[i - start] : ' ';
+		if (c < FIRST_GLYPH || c > LAST_GLYPH)
+			c = '?';
+		if (c == line->shown[i])
+			continue;
+
+		// One row of the glyph at a time, from the atlas as it is
+		const uint8_t *src = atlas->pixels + (c - FIRST_GLYPH) * cell_size(atlas);
+		size_t row_size = (size_t)atlas->cell_width * atlas->cpp;
+		uint8_t *dst = fb->data + (size_t)line->y * fb->stride +
+			(size_t)(line->x + i * atlas->cell_width) * fb->cpp;
+		for (uint32_t y = 0; y < atlas->cell_height; ++y)
+			stream_copy(dst + (size_t)y * fb->stride, src + y * row_size, row_size);
+
+		line->shown[i] = c;
+		if (!changed)
+			first = i;
+		last = i;
+		changed = true;
+	}
+
+	if (!changed)
+		return false;
+
+	clip->x1 = line->x + first * atlas->cell_width;
+	clip->y1 = line->y;
+	clip->x2 = line->x + (last + 1) * atlas->cell_width;
+	clip->y2 = line->y + atlas->cell_height;
+	return true;
+}
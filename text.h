@@ -0,0 +1,62 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "fb.h"
+
+// Longest line of text shown, in characters
+#define TEXT_MAX_LENGTH 80
+
+/*
+ * The built-in 5x7 font, rendered in one framebuffer format, size and pair
+ * of colours, so glyphs can be copied straight into a framebuffer.
+ */
+struct font_atlas {
+	uint32_t format;
+	uint32_t scale; // pixels per font pixel
+	uint32_t fg, bg; // XRGB8888
+
+	uint32_t cell_width, cell_height; // of each glyph with its spacing
+	uint32_t cpp;
+	uint8_t *pixels; // every glyph cell, top to bottom, with no padding
+
+	struct font_atlas *next;
+};
+
+/*
+ * Find the atlas with the given format, size and colours in 'cache', or
+ * render it and add it there. Displays with the same format and size
+ * share one. Returns NULL if it couldn't be allocated.
+ */
+const struct font_atlas *font_atlas_get(struct font_atlas **cache, uint32_t format,
+		uint32_t scale, uint32_t fg, uint32_t bg);
+void font_atlas_free(struct font_atlas **cache);
+
+/*
+ * A line of text centred in a framebuffer, one glyph cell per character.
+ */
+struct text_line {
+	uint32_t x, y;
+	uint32_t length; // in cells, may be 0 if there's no room
+	char shown[TEXT_MAX_LENGTH]; // character in each cell, or 0 if not drawn yet
+};
+
+/*
+ * Lay out a line of 'atlas' glyphs across a 'width' x 'height' framebuffer,
+ * with its top at 'y'.
+ */
+void text_line_init(struct text_line *line, const struct font_atlas *atlas,
+		uint32_t width, uint32_t height, uint32_t y);
+
+/*
+ * Show 'text', centred and cut short if it doesn't fit, replacing whatever
+ * the line showed before. Only the cells that changed are written, and
+ * 'clip' is set to cover them for fb_flush(). Returns false if nothing did.
+ */
+bool text_draw(const struct font_atlas *atlas, struct text_line *line,
+		struct dumb_framebuffer *fb, const char *text, drmModeClip *clip);
+
+#endif
@@ -0,0 +1,80 @@
+#include "timing.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_RECORDS 256
+
+struct record {
+	const char *stage;
+	char object[32];
+	uint64_t start;
+	uint64_t duration;
+};
+
+// Stages run on several threads during bring-up
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct record records[MAX_RECORDS];
+static int num_records;
+
+/*
+ * CLOCK_MONOTONIC in nanoseconds, i.e. time since boot minus suspend.
+ */
+uint64_t timing_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Record that 'stage' ran from 'start' (from timing_now()) until now.
+ * 'object' says what it ran on, e.g. a connector name, and may be NULL.
+ */
+void timing_record(const char *stage, const char *object, uint64_t start)
+{
+	uint64_t end = timing_now();
+
+	pthread_mutex_lock(&lock);
+	if (num_records < MAX_RECORDS) {
+		struct record *r = &records[num_records++];
+		r->stage = stage;
+		snprintf(r->object, sizeof r->object, "%s", object ? object : "");
+		r->start = start;
+		r->duration = end - start;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Write every recorded stage to 'path', or to stderr if 'path' is "-",
+ * as one JSON object per line:
+ *   {"stage":"create_fb","object":"HDMI-A-1","start_us":812345,"duration_us":1520}
+ * 'start_us' is the absolute CLOCK_MONOTONIC time, so reports from different
+ * boots line up against kernel timestamps.
+ */
+bool timing_report(const char *path)
+{
+	FILE *out = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+	if (!out) {
+		perror(path);
+		return false;
+	}
+
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < num_records; ++i) {
+		const struct record *r = &records[i];
+		fprintf(out, "{\"stage\":\"%s\",\"object\":\"%s\",\"start_us\":%"PRIu64",\"duration_us\":%"PRIu64"}\n",
+				r->stage, r->object, r->start / 1000, r->duration / 1000);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (out != stderr)
+		return fclose(out) == 0;
+
+	fflush(out);
+	return true;
+}
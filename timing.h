@@ -0,0 +1,27 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * CLOCK_MONOTONIC in nanoseconds, i.e. time since boot minus suspend.
+ */
+uint64_t timing_now(void);
+
+/*
+ * Record that 'stage' ran from 'start' (from timing_now()) until now.
+ * 'object' says what it ran on, e.g. a connector name, and may be NULL.
+ */
+void timing_record(const char *stage, const char *object, uint64_t start);
+
+/*
+ * Write every recorded stage to 'path', or to stderr if 'path' is "-",
+ * as one JSON object per line:
+ *   {"stage":"create_fb","object":"HDMI-A-1","start_us":812345,"duration_us":1520}
+ * 'start_us' is the absolute CLOCK_MONOTONIC time, so reports from different
+ * boots line up against kernel timestamps.
+ */
+bool timing_report(const char *path);
+
+#endif
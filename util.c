@@ -1,6 +1,9 @@
 #include "util.h"
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -37,7 +40,7 @@ const char *conn_str(uint32_t conn_type)
  * Calculate an accurate refresh rate from 'mode'.
  * The result is in mHz.
  */
-int refresh_rate(drmModeModeInfo *mode)
+int refresh_rate(const drmModeModeInfo *mode)
 {
 	int res = (mode->clock * 1000000LL / mode->htotal + mode->vtotal / 2) / mode->vtotal;
 
@@ -52,3 +55,56 @@ int refresh_rate(drmModeModeInfo *mode)
 
 	return res;
 }
+
+/*
+ * Check whether two modes have identical timings.
+ * Names and type flags are ignored.
+ */
+bool mode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->clock == b->clock &&
+		a->hdisplay == b->hdisplay &&
+		a->hsync_start == b->hsync_start &&
+		a->hsync_end == b->hsync_end &&
+		a->htotal == b->htotal &&
+		a->hskew == b->hskew &&
+		a->vdisplay == b->vdisplay &&
+		a->vsync_start == b->vsync_start &&
+		a->vsync_end == b->vsync_end &&
+		a->vtotal == b->vtotal &&
+		a->vscan == b->vscan &&
+		a->flags == b->flags;
+}
+
+/*
+ * Run 'fn' on each of the 'count' jobs of 'size' bytes at 'jobs', all
+ * concurrently with one thread per job, and wait for them to finish.
+ * Jobs that can't get a thread of their own run inline.
+ */
+void run_parallel(void *(*fn)(void *), void *jobs, size_t size, int count)
+{
+	pthread_t *threads = calloc(count ? count : 1, sizeof *threads);
+	bool *started = calloc(count ? count : 1, sizeof *started);
+	if (!threads || !started) {
+		for (int i = 0; i < count; ++i)
+			fn((uint8_t *)jobs + i * size);
+		free(threads);
+		free(started);
+		return;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		void *job = (uint8_t *)jobs + i * size;
+		started[i] = pthread_create(&threads[i], NULL, fn, job) == 0;
+		if (!started[i])
+			fn(job);
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	free(started);
+}
@@ -1,6 +1,8 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -15,6 +17,19 @@ const char *conn_str(uint32_t conn_type);
  * Calculate an accurate refresh rate from 'mode'.
  * The result is in mHz.
  */
-int refresh_rate(drmModeModeInfo *mode);
+int refresh_rate(const drmModeModeInfo *mode);
+
+/*
+ * Check whether two modes have identical timings.
+ * Names and type flags are ignored.
+ */
+bool mode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b);
+
+/*
+ * Run 'fn' on each of the 'count' jobs of 'size' bytes at 'jobs', all
+ * concurrently with one thread per job, and wait for them to finish.
+ * Jobs that can't get a thread of their own run inline.
+ */
+void run_parallel(void *(*fn)(void *), void *jobs, size_t size, int count);
 
 #endif